@@ -0,0 +1,646 @@
+// Micro and macro benchmarks for the renderer.
+//
+// Micro benchmarks time one small operation (a box test, a sphere test, a scatter...) repeated until the timing is
+// stable, and report nanoseconds per operation. Macro benchmarks time BVH builds and full renders of reference scenes,
+// and report rays per second for the renders. Every scene is generated from a fixed seed and the sampler seeds each
+// pixel sample from its position (see sampler.h), so runs of the same build trace exactly the same rays.
+//
+// Results are printed as a table to standard error and as JSON to standard output (or to the --json file), for
+// comparing builds:
+//
+//     ./build/bench [--filter=<substring>] [--min-time=<seconds>] [--threads=<n>] [--json=<file>]
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "bvh_builder.h"
+#include "camera.h"
+#include "dynamic_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "image_writer.h"
+#include "instance.h"
+#include "linear_bvh.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "wide_bvh.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Settings from the command line.
+struct bench_options {
+    std::string filter;             // Only run benchmarks whose name contains this
+    double min_time = 0.25;         // Least time (seconds) a measurement must take to be reported
+    int threads = 1;                // Render threads for the macro benchmarks (1 gives the most repeatable timings)
+    std::string json_file;          // Where to write the JSON results (standard output if empty)
+};
+
+
+struct bench_result {
+    std::string name;
+    std::string kind;               // "micro" or "macro"
+    long long iterations;           // Number of operations timed
+    double seconds;                 // Total time of the timed operations
+    double rays;                    // Rays traced (renders only, otherwise 0)
+
+    double ns_per_op() const { return seconds * 1e9 / double(iterations); }
+    double rays_per_second() const { return rays > 0 ? rays / seconds : 0; }
+};
+
+
+// Results of timed code are added to this, so that the compiler cannot remove the code as unused.
+volatile double bench_sink = 0;
+
+
+// Times body(n), which must perform n operations and return any value computed from them. n is raised until one call
+// takes at least min_time seconds, and that call is reported.
+bench_result measure(const std::string& name, const std::string& kind, double min_time, const std::function<double(long long)>& body) {
+
+    long long n = 1;
+    while (true) {
+        auto start = std::chrono::steady_clock::now();
+        bench_sink = bench_sink + body(n);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (seconds >= min_time || n >= (1LL << 40))
+            return bench_result{name, kind, n, seconds, 0};
+
+        // Aim a little past min_time, growing by at most 100x at a time.
+        double scale = seconds > 0 ? 1.2 * min_time / seconds : 100;
+        n = (long long)(double(n) * std::min(100.0, std::max(2.0, scale)));
+    }
+}
+
+
+// Counts the rays traced through a world: every ray segment of a path is one call to the world's hit() (or one lane
+// of a packet). The counter is shared by the render threads, which adds one atomic increment per ray.
+class ray_counter : public hittable {
+
+  public:
+
+    explicit ray_counter(const hittable& world) : world(world), rays(0) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        rays.fetch_add(1, std::memory_order_relaxed);
+        return world.hit(r, ray_t, rec);
+    }
+
+    unsigned int hit_packet(ray_packet& packet, unsigned int active, hit_record recs[]) const override {
+        int lanes = 0;
+        for (unsigned int bits = active; bits != 0; bits &= bits - 1)
+            lanes++;
+        rays.fetch_add(lanes, std::memory_order_relaxed);
+        return world.hit_packet(packet, active, recs);
+    }
+
+    aabb bounding_box() const override { return world.bounding_box(); }
+
+    long long count() const { return rays.load(); }
+
+  private:
+    const hittable& world;
+    mutable std::atomic<long long> rays;
+};
+
+
+// Scenes
+
+// The final scene of "Ray Tracing in One Weekend" (as main.cc), with the spheres added to set or, if set is null, as
+// sphere objects in world. streak is added to the motion of each moving sphere.
+void add_book_spheres(hittable_list& world, sphere_set* set, uint64_t seed, const vec3& streak = vec3(0,0,0)) {
+
+    sampler::begin_sample(seed, 0);
+
+    auto add = [&](const point3& center1, const point3& center2, double radius, shared_ptr<material> mat) {
+        if (set)
+            set->add(center1, center2, radius, mat);
+        else
+            world.add(make_shared<sphere>(center1, center2, radius, mat));
+    };
+
+    add(point3(0,-1000,0), point3(0,-1000,0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                if (choose_mat < 0.8) {
+                    auto albedo = color::random() * color::random();
+                    add(center, center + vec3(0, random_double(0,.5), 0) + streak, 0.2, make_shared<lambertian>(albedo));
+                } else if (choose_mat < 0.95) {
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    add(center, center, 0.2, make_shared<metal>(albedo, fuzz));
+                } else {
+                    add(center, center, 0.2, make_shared<dielectric>(1.5));
+                }
+            }
+        }
+    }
+
+    add(point3(0, 1, 0), point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5));
+    add(point3(-4, 1, 0), point3(-4, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1)));
+    add(point3(4, 1, 0), point3(4, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0));
+}
+
+// A forest of side x side copies of three kinds of tree (each a sphere_set: a trunk and a crown of leaves), turned,
+// scaled and jittered at random on a grid of spacing 3 centred on the origin.
+void add_forest(instance_set& forest, int side, uint64_t seed) {
+
+    sampler::begin_sample(seed, 0);
+
+    auto bark = make_shared<lambertian>(color(0.4, 0.25, 0.1));
+    std::vector<shared_ptr<hittable>> trees;
+    for (int kind = 0; kind < 3; kind++) {
+        auto tree = make_shared<sphere_set>();
+        auto leaves = make_shared<lambertian>(color(0.1 + 0.1*kind, 0.5, 0.1));
+        for (int k = 0; k < 6; k++)
+            tree->add(point3(0, 0.2*k, 0), 0.15, bark);
+        for (int k = 0; k < 40 + 20*kind; k++)
+            tree->add(point3(random_double(-0.6,0.6), 1.2 + random_double(0, 0.8 + 0.4*kind), random_double(-0.6,0.6)), 0.2, leaves);
+        tree->build();
+        trees.push_back(tree);
+    }
+
+    for (int a = 0; a < side; a++)
+        for (int b = 0; b < side; b++) {
+            point3 place(3.0 * (a - side/2) + random_double(-1,1), 0, 3.0 * (b - side/2) + random_double(-1,1));
+            forest.add(trees[int(3 * random_double())],
+                       transform::translation(place) * transform::rotation(vec3(0,1,0), random_double(0, 360))
+                           * transform::scaling(random_double(0.7, 1.3)));
+        }
+    forest.build();
+}
+
+// n spheres of radius 0.05 scattered through a cube of side 20, for the BVH benchmarks.
+std::vector<shared_ptr<hittable>> random_spheres(int n, uint64_t seed) {
+    sampler::begin_sample(seed, 0);
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    std::vector<shared_ptr<hittable>> objects;
+    for (int k = 0; k < n; k++)
+        objects.push_back(make_shared<sphere>(point3(random_double(-10,10), random_double(-10,10), random_double(-10,10)), 0.05, mat));
+    return objects;
+}
+
+// The camera of main.cc, at a small size.
+camera book_camera(const bench_options& options) {
+    camera cam;
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 160;
+    cam.samples_per_pixel = 8;
+    cam.max_depth         = 50;
+    cam.vfov     = 20;
+    cam.lookfrom = point3(13,2,3);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+    cam.defocus_angle = 0.6;
+    cam.focus_dist    = 10.0;
+    cam.num_threads   = options.threads;
+    return cam;
+}
+
+// Random rays from around the origin, towards random points in a cube of side 4.
+std::vector<ray> random_rays(int n, uint64_t seed) {
+    sampler::begin_sample(seed, 0);
+    std::vector<ray> rays;
+    for (int k = 0; k < n; k++) {
+        point3 origin = point3(0, 0, 8) + vec3::random(-1, 1);
+        point3 target = vec3::random(-2, 2);
+        rays.push_back(ray(origin, target - origin, random_double()));
+    }
+    return rays;
+}
+
+
+// Benchmarks
+
+class bench_runner {
+
+  public:
+
+    explicit bench_runner(const bench_options& options) : options(options) {}
+
+    std::vector<bench_result> results;
+
+    void micro(const std::string& name, const std::function<double(long long)>& body) {
+        run(name, "micro", body);
+    }
+
+    void macro(const std::string& name, const std::function<double(long long)>& body) {
+        run(name, "macro", body);
+    }
+
+    // Times full renders of world with cam, and counts their rays.
+    void render(const std::string& name, const hittable& world, camera cam) {
+        if (!selected(name))
+            return;
+
+        ray_counter counter(world);
+        long long rays_before = 0;
+
+        bench_result result = measure(name, "macro", options.min_time, [&](long long n) {
+            rays_before = counter.count();
+            double sum = 0;
+            for (long long k = 0; k < n; k++) {
+                framebuffer image = cam.render_image(counter);
+                sum += image[0].x();
+            }
+            return sum;
+        });
+        result.rays = double(counter.count() - rays_before);
+
+        report(result);
+    }
+
+    bool selected(const std::string& name) const {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    // Writes all the results as JSON.
+    void write_json(std::ostream& out) const {
+        out << "{\n";
+        out << "  \"format_version\": 1,\n";
+        out << "  \"real\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\",\n";
+#ifdef __VERSION__
+        out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+#endif
+#ifdef __OPTIMIZE__
+        out << "  \"optimized\": true,\n";
+#else
+        out << "  \"optimized\": false,\n";
+#endif
+        out << "  \"threads\": " << options.threads << ",\n";
+        out << "  \"benchmarks\": [\n";
+        for (size_t k = 0; k < results.size(); k++) {
+            const bench_result& r = results[k];
+            out << "    {\"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\", \"iterations\": " << r.iterations
+                << ", \"seconds\": " << r.seconds << ", \"ns_per_op\": " << r.ns_per_op();
+            if (r.rays > 0)
+                out << ", \"rays\": " << (long long)r.rays << ", \"rays_per_second\": " << r.rays_per_second();
+            out << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n";
+        out << "}\n";
+    }
+
+  private:
+
+    bench_options options;
+
+    void run(const std::string& name, const std::string& kind, const std::function<double(long long)>& body) {
+        if (selected(name))
+            report(measure(name, kind, options.min_time, body));
+    }
+
+    void report(const bench_result& result) {
+        results.push_back(result);
+
+        std::cerr << result.name << std::string(result.name.size() < 32 ? 32 - result.name.size() : 1, ' ');
+        if (result.ns_per_op() >= 1e6)
+            std::cerr << result.ns_per_op() / 1e6 << " ms/op";
+        else
+            std::cerr << result.ns_per_op() << " ns/op";
+        if (result.rays > 0)
+            std::cerr << "   " << result.rays_per_second() / 1e6 << " Mrays/s";
+        std::cerr << std::endl;
+    }
+};
+
+
+void run_micro_benchmarks(bench_runner& bench) {
+
+    const int n_rays = 1024;                                // Power of two, so that k & (n_rays - 1) cycles through them
+    std::vector<ray> rays = random_rays(n_rays, 1);
+
+    aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+    bench.micro("aabb_hit", [&](long long n) {
+        double hits = 0;
+        for (long long k = 0; k < n; k++)
+            hits += box.hit(rays[k & (n_rays - 1)], interval(ray_t_min, infinity));
+        return hits;
+    });
+
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    sphere ball(point3(0, 0, 0), 1.0, mat);
+    bench.micro("sphere_hit", [&](long long n) {
+        double hits = 0;
+        hit_record rec;
+        for (long long k = 0; k < n; k++)
+            hits += ball.hit(rays[k & (n_rays - 1)], interval(ray_t_min, infinity), rec);
+        return hits;
+    });
+
+    // Traversal of the different BVHs over the same 10,000 spheres.
+    hittable_list spheres;
+    for (auto& object : random_spheres(10000, 2))
+        spheres.add(object);
+
+    std::vector<ray> scene_rays;
+    sampler::begin_sample(3, 0);
+    for (int k = 0; k < n_rays; k++) {
+        point3 origin = vec3::random(-12, 12);
+        scene_rays.push_back(ray(origin, vec3::random(-10, 10) - origin, 0));
+    }
+
+    auto traverse = [&](const hittable& tree) {
+        return [&](long long n) {
+            double hits = 0;
+            hit_record rec;
+            for (long long k = 0; k < n; k++)
+                hits += tree.hit(scene_rays[k & (n_rays - 1)], interval(ray_t_min, infinity), rec);
+            return hits;
+        };
+    };
+
+    bvh_build_options sah;
+    sah.split = bvh_split_method::sah;
+
+    if (bench.selected("bvh_node_traversal")) {
+        bvh_node tree(spheres);
+        bench.micro("bvh_node_traversal", traverse(tree));
+    }
+    if (bench.selected("linear_bvh_traversal")) {
+        linear_bvh tree(spheres, sah);
+        bench.micro("linear_bvh_traversal", traverse(tree));
+    }
+    if (bench.selected("bvh8_traversal")) {
+        bvh8 tree(spheres, sah);
+        bench.micro("bvh8_traversal", traverse(tree));
+    }
+    if (bench.selected("sphere_set_traversal")) {
+        sphere_set set;
+        sampler::begin_sample(2, 0);
+        for (int k = 0; k < 10000; k++)
+            set.add(point3(random_double(-10,10), random_double(-10,10), random_double(-10,10)), 0.05, mat);
+        set.build();
+        bench.micro("sphere_set_traversal", traverse(set));
+    }
+
+    bench.micro("random_unit_vector", [&](long long n) {
+        sampler::begin_sample(4, 0);
+        vec3 sum;
+        for (long long k = 0; k < n; k++)
+            sum += random_unit_vector();
+        return double(sum.x());
+    });
+
+    // Scattering off a fixed hit on the top of a unit sphere.
+    hit_record rec;
+    ray incoming(point3(0.5, 2, 0), vec3(-0.5, -1, 0));
+    ball.hit(incoming, interval(ray_t_min, infinity), rec);
+
+    auto scatter = [&](const material& m) {
+        return [&](long long n) {
+            sampler::begin_sample(5, 0);
+            double sum = 0;
+            ray scattered;
+            color attenuation;
+            for (long long k = 0; k < n; k++) {
+                if (m.scatter(incoming, rec, attenuation, scattered))
+                    sum += scattered.direction().x();
+            }
+            return sum;
+        };
+    };
+
+    lambertian diffuse(color(0.5, 0.5, 0.5));
+    metal shiny(color(0.7, 0.6, 0.5), 0.3);
+    dielectric glass(1.5);
+    bench.micro("lambertian_scatter", scatter(diffuse));
+    bench.micro("metal_scatter", scatter(shiny));
+    bench.micro("dielectric_scatter", scatter(glass));
+
+    bench.micro("write_color", [&](long long n) {
+        std::ostringstream out;
+        double size = 0;
+        for (long long k = 0; k < n; k++) {
+            write_color(out, color(double(k & 255) / 255, 0.5, 0.25));
+            if ((k & 4095) == 4095) {
+                size += double(out.tellp());
+                out.str("");
+            }
+        }
+        return size;
+    });
+
+    // Encoding a whole 400 x 225 image (one operation is one image).
+    framebuffer image(400, 225);
+    for (int j = 0; j < image.height(); j++)
+        for (int i = 0; i < image.width(); i++)
+            image.at(i, j) = color(double(i) / image.width(), double(j) / image.height(), 0.5);
+
+    bench.micro("encode_ppm_text", [&](long long n) {
+        double size = 0;
+        for (long long k = 0; k < n; k++)
+            size += double(image_writer::encode(image, image_format::ppm_text).size());
+        return size;
+    });
+    bench.micro("encode_ppm", [&](long long n) {
+        double size = 0;
+        for (long long k = 0; k < n; k++)
+            size += double(image_writer::encode(image, image_format::ppm).size());
+        return size;
+    });
+    bench.micro("encode_png", [&](long long n) {
+        double size = 0;
+        for (long long k = 0; k < n; k++)
+            size += double(image_writer::encode(image, image_format::png).size());
+        return size;
+    });
+}
+
+
+void run_macro_benchmarks(bench_runner& bench, const bench_options& options) {
+
+    // BVH builds over 200,000 spheres.
+    std::vector<shared_ptr<hittable>> objects = random_spheres(200000, 6);
+    std::vector<aabb> boxes;
+    for (const auto& object : objects)
+        boxes.push_back(object->bounding_box());
+
+    auto build = [&](bvh_build_options build_options) {
+        return [&, build_options](long long n) {
+            double nodes = 0;
+            for (long long k = 0; k < n; k++)
+                nodes += double(bvh_builder(boxes, build_options).nodes.size());
+            return nodes;
+        };
+    };
+
+    bvh_build_options median;
+    median.num_threads = options.threads;
+    bvh_build_options sah = median;
+    sah.split = bvh_split_method::sah;
+
+    bench.macro("bvh_build_median_200k", build(median));
+    bench.macro("bvh_build_sah_200k", build(sah));
+
+    if (bench.selected("bvh_node_build_200k")) {
+        bench.macro("bvh_node_build_200k", [&](long long n) {
+            double sum = 0;
+            for (long long k = 0; k < n; k++) {
+                hittable_list list;
+                list.objects = objects;
+                bvh_node tree(list);
+                sum += tree.bounding_box().x.min;
+            }
+            return sum;
+        });
+    }
+
+    // Updates of a dynamic_bvh over the same spheres: refitting every box, and taking one sphere out and putting it
+    // back (which gets it the same id).
+    if (bench.selected("dynamic_bvh_refit_200k") || bench.selected("dynamic_bvh_reinsert_200k")) {
+        hittable_list list;
+        list.objects = objects;
+        dynamic_bvh tree(list);
+        tree.num_threads = options.threads;
+        tree.rebuild_threshold = 0;         // Time the updates alone
+
+        bench.macro("dynamic_bvh_refit_200k", [&](long long n) {
+            for (long long k = 0; k < n; k++)
+                tree.refit();
+            return tree.sah_cost();
+        });
+        bench.macro("dynamic_bvh_reinsert_200k", [&](long long n) {
+            double sum = 0;
+            for (long long k = 0; k < n; k++) {
+                uint32_t id = uint32_t(k % (long long)objects.size());
+                tree.remove(id);
+                sum += tree.insert(objects[id]);
+            }
+            return sum;
+        });
+    }
+
+    // Full renders of reference scenes.
+    if (bench.selected("render_book") || bench.selected("render_book_wavefront")) {
+        auto set = make_shared<sphere_set>();
+        hittable_list unused;
+        add_book_spheres(unused, set.get(), 7);
+        set->build();
+        hittable_list world(set);
+
+        camera cam = book_camera(options);
+        bench.render("render_book", world, cam);
+
+        cam.integrator = integrator_type::wavefront;
+        bench.render("render_book_wavefront", world, cam);
+    }
+
+    if (bench.selected("render_book_streaks")) {
+        // The moving spheres travel several times their spacing while the shutter is open, so the sphere_set tests
+        // rays against its boxes at the rays' times (see motion_bvh.h).
+        auto set = make_shared<sphere_set>();
+        hittable_list unused;
+        add_book_spheres(unused, set.get(), 7, vec3(3, 2, 0));
+        set->build();
+        hittable_list world(set);
+
+        camera cam = book_camera(options);
+        bench.render("render_book_streaks", world, cam);
+    }
+
+    if (bench.selected("render_book_spheres") || bench.selected("render_book_spheres_packets")) {
+        hittable_list spheres;
+        add_book_spheres(spheres, nullptr, 7);
+        bvh_build_options build_options;
+        build_options.split = bvh_split_method::sah;
+        hittable_list world(make_shared<linear_bvh>(spheres, build_options));
+
+        camera cam = book_camera(options);
+        bench.render("render_book_spheres", world, cam);
+
+        cam.packet_tracing = true;
+        bench.render("render_book_spheres_packets", world, cam);
+    }
+
+    if (bench.selected("render_forest_1m")) {
+        // A million trees (about 66 million spheres) in a top-level BVH over copies of three sphere_sets.
+        hittable_list world;
+        world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+        auto forest = make_shared<instance_set>();
+        add_forest(*forest, 1000, 7);
+        world.add(forest);
+
+        camera cam = book_camera(options);
+        cam.lookfrom = point3(0, 6, -20);
+        cam.lookat = point3(0, 0, 20);
+        cam.vfov = 50;
+        cam.defocus_angle = 0;
+        bench.render("render_forest_1m", world, cam);
+    }
+
+    if (bench.selected("render_materials")) {
+        // Three large spheres of each material on a ground plane, filling the view: mostly scattering, little sky.
+        hittable_list world;
+        world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+        world.add(make_shared<sphere>(point3(-2.2, 1, 0), 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+        world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+        world.add(make_shared<sphere>(point3(2.2, 1, 0), 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.1)));
+
+        camera cam = book_camera(options);
+        cam.lookfrom = point3(0, 2, 8);
+        cam.lookat = point3(0, 1, 0);
+        cam.vfov = 40;
+        cam.defocus_angle = 0;
+        bench.render("render_materials", world, cam);
+    }
+}
+
+
+int main(int argc, char** argv) {
+
+    bench_options options;
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+        auto value = [&](const char* prefix) -> const char* {
+            size_t length = std::strlen(prefix);
+            return arg.compare(0, length, prefix) == 0 ? argv[k] + length : nullptr;
+        };
+
+        if (const char* v = value("--filter="))
+            options.filter = v;
+        else if (const char* v = value("--min-time="))
+            options.min_time = std::atof(v);
+        else if (const char* v = value("--threads="))
+            options.threads = std::max(1, std::atoi(v));
+        else if (const char* v = value("--json="))
+            options.json_file = v;
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--filter=<substring>] [--min-time=<seconds>] [--threads=<n>] [--json=<file>]\n";
+            return 1;
+        }
+    }
+
+    // The renders' progress messages (on std::clog) would interleave with the results table, so they are discarded.
+    std::ostringstream discarded;
+    std::streambuf* clog_buffer = std::clog.rdbuf(discarded.rdbuf());
+
+    bench_runner bench(options);
+    run_micro_benchmarks(bench);
+    run_macro_benchmarks(bench, options);
+
+    std::clog.rdbuf(clog_buffer);
+
+    if (options.json_file.empty()) {
+        bench.write_json(std::cout);
+    } else {
+        std::ofstream out(options.json_file);
+        bench.write_json(out);
+    }
+
+    return 0;
+}
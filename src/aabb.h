@@ -1,36 +1,46 @@
 #pragma once
 
-// 3D axis-aligned bounding box class
-class aabb {
+#include "render_stats.h"
+
+#include <algorithm>
+
+// 3D axis-aligned bounding box class, with coordinates of scalar type T. The renderer uses basic_aabb<real> (aabb).
+template <typename T>
+class basic_aabb {
 
     public:
 
+        using interval_type = basic_interval<T>;
+        using vec_type = basic_vec3<T>;
+
         // Intervals in the x,y,z dimensions defining the coordinates of the bounding planes.
-        interval x, y, z;
+        interval_type x, y, z;
     
-        aabb() {} // The default AABB is empty, since intervals are empty by default.
+        basic_aabb() {} // The default AABB is empty, since intervals are empty by default.
     
-        aabb(const interval& x, const interval& y, const interval& z)
+        basic_aabb(const interval_type& x, const interval_type& y, const interval_type& z)
             : x(x), y(y), z(z) {}
     
-        aabb(const point3& a, const point3& b) {
+        basic_aabb(const vec_type& a, const vec_type& b) {
             // Treat the two points a and b as extrema for the bounding box, so we don't require a
             // particular minimum/maximum coordinate order. ie, a = (x0, y0, z0), b = (x1, y1, z1).
     
-            x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
-            y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
-            z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+            x = (a[0] <= b[0]) ? interval_type(a[0], b[0]) : interval_type(b[0], a[0]);
+            y = (a[1] <= b[1]) ? interval_type(a[1], b[1]) : interval_type(b[1], a[1]);
+            z = (a[2] <= b[2]) ? interval_type(a[2], b[2]) : interval_type(b[2], a[2]);
+
+            pad_to_minimums();
         }
 
         // Create a bouding box that encompasses box0 and box1 (the interval constructor deals with the min/max)
-        aabb(const aabb& box0, const aabb& box1) {
-            x = interval(box0.x, box1.x);
-            y = interval(box0.y, box1.y);
-            z = interval(box0.z, box1.z);
+        basic_aabb(const basic_aabb& box0, const basic_aabb& box1) {
+            x = interval_type(box0.x, box1.x);
+            y = interval_type(box0.y, box1.y);
+            z = interval_type(box0.z, box1.z);
         }
     
         // Return the bounding box interval of a particular dimension.
-        const interval& axis_interval(int n) const {
+        const interval_type& axis_interval(int n) const {
             if (n == 1) return y;
             if (n == 2) return z;
             return x;
@@ -38,38 +48,35 @@ class aabb {
     
 
         // ray_t is a copy of the interval over which intersections of the incoming ray are valid
-        bool hit(const ray& r, interval ray_t) const {
-            const point3& ray_orig = r.origin();
-            const vec3&   ray_dir  = r.direction();
-    
-            // Test for whether a ray hits a bounding box. Look at each axis independently.
-            // Reminder for ray equation: _P(t) = _Q + t*_d.
-            // For bounding box intersections: t_i = (P_i - Q_i)/d_i for each i=x,y,z
-            for (int axis = 0; axis < 3; axis++) {
+        bool hit(const basic_ray<T>& r, interval_type ray_t) const {
+            const T box_min[3] = { x.min, y.min, z.min };
+            const T box_max[3] = { x.max, y.max, z.max };
+            return hit_slabs(r, box_min, box_max, ray_t);
+        }
 
-                const interval& ax = axis_interval(axis);       
-                const double adinv = 1.0 / ray_dir[axis];
-    
-                // t_i = (P_i - Q_i)/d_i for max and min of bounding box.
-                auto t0 = (ax.min - ray_orig[axis]) * adinv;
-                auto t1 = (ax.max - ray_orig[axis]) * adinv;
-    
-                // A hit is defined by an overlap in the tx,ty,tz over which the ray intersects the planes of the bounding box.
-                // Note that the initial intersection of the ray with the bounding box in x (axis=0) is compared to the ray's interval of valid intersections.
-                if (t0 < t1) {
-                    if (t0 > ray_t.min) ray_t.min = t0;
-                    if (t1 < ray_t.max) ray_t.max = t1;
-                } else {
-                    if (t1 > ray_t.min) ray_t.min = t1;
-                    if (t0 < ray_t.max) ray_t.max = t0;
-                }
-    
-                // Immediately return false if any of the axes don't satisfy the overlap condition.
-                if (ray_t.max <= ray_t.min)
-                    return false;
-            }
 
-            return true;
+        // Branchless slab test of ray r against the box [box_min, box_max] (in double or single precision).
+        // Reminder for ray equation: _P(t) = _Q + t*_d.
+        // For bounding box intersections: t_i = (P_i - Q_i)/d_i for each i=x,y,z, using the ray's precomputed 1/d_i.
+        // The ray's direction signs say which plane of each pair the ray meets first (near) and last (far), and a hit
+        // is an overlap of the near-far intervals of all three axes and ray_t. There is no per-axis loop or early exit.
+        template <typename B>
+        static bool hit_slabs(const basic_ray<T>& r, const B box_min[3], const B box_max[3], interval_type ray_t) {
+            RTW_STAT(box_tests, 1);
+
+            const vec_type& orig = r.origin();
+            const vec_type& inv_dir = r.inv_direction();
+
+            T tx_near = (T(r.dir_is_neg(0) ? box_max[0] : box_min[0]) - orig[0]) * inv_dir[0];
+            T tx_far  = (T(r.dir_is_neg(0) ? box_min[0] : box_max[0]) - orig[0]) * inv_dir[0];
+            T ty_near = (T(r.dir_is_neg(1) ? box_max[1] : box_min[1]) - orig[1]) * inv_dir[1];
+            T ty_far  = (T(r.dir_is_neg(1) ? box_min[1] : box_max[1]) - orig[1]) * inv_dir[1];
+            T tz_near = (T(r.dir_is_neg(2) ? box_max[2] : box_min[2]) - orig[2]) * inv_dir[2];
+            T tz_far  = (T(r.dir_is_neg(2) ? box_min[2] : box_max[2]) - orig[2]) * inv_dir[2];
+
+            T t_enter = std::max(std::max(tx_near, ty_near), std::max(tz_near, ray_t.min));
+            T t_exit  = std::min(std::min(tx_far, ty_far), std::min(tz_far, ray_t.max));
+            return t_enter < t_exit;
         }
 
 
@@ -82,11 +89,33 @@ class aabb {
         }
 
 
+        // Total area of the six faces of the box (zero for an empty box). Used by the surface area heuristic.
+        double surface_area() const {
+            if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+                return 0;
+            return 2 * (x.size()*y.size() + y.size()*z.size() + z.size()*x.size());
+        }
+
+
         // Bounding boxes that encompass nothing (empty), or everything (universe).
-        static const aabb empty, universe;
+        static const basic_aabb empty, universe;
+
+
+    private:
+
+        // Adjust the AABB so that no side is narrower than aabb_padding (see rtweekend.h), padding if necessary, so that
+        // boxes of flat objects still have a volume for rays to enter.
+        void pad_to_minimums() {
+            T delta = T(aabb_padding);
+            if (x.size() < delta) x = x.expand(delta);
+            if (y.size() < delta) y = y.expand(delta);
+            if (z.size() < delta) z = z.expand(delta);
+        }
 };
 
 
 // Define static constants for bounding boxes that contain everything or nothing.
-const aabb aabb::empty    = aabb(interval::empty,    interval::empty,    interval::empty);
-const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
\ No newline at end of file
+template <typename T> const basic_aabb<T> basic_aabb<T>::empty    = basic_aabb<T>(basic_interval<T>::empty,    basic_interval<T>::empty,    basic_interval<T>::empty);
+template <typename T> const basic_aabb<T> basic_aabb<T>::universe = basic_aabb<T>(basic_interval<T>::universe, basic_interval<T>::universe, basic_interval<T>::universe);
+
+using aabb = basic_aabb<real>;
\ No newline at end of file
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "color.h"
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+// Sums of the samples rendered so far in each pixel, for progressive rendering: passes of samples are added as they
+// finish, and the current image (the mean) can be taken at any time. The sums are kept in single precision, which is
+// plenty for the few thousand samples a pixel receives and halves the size of the buffer and of its checkpoints.
+//
+// Every pixel has received the same number of samples (samples_done()), and samples are numbered in order, so a
+// checkpoint of the sums and that count is all that is needed to resume a render exactly where it stopped: the random
+// numbers of the remaining samples depend only on their pixel and sample number (see sampler.h). The checkpoint also
+// records a key of the scene and render settings the samples were taken with (see camera::render_key()), and is only
+// resumed by a render with the same key.
+class accumulation_buffer {
+
+  public:
+
+    accumulation_buffer(int width, int height, uint64_t key = 0) :
+      width(width),
+      height(height),
+      key(key),
+      samples(0),
+      sums(size_t(width) * height * 3, 0.0f) {}
+
+    int samples_done() const { return samples; }
+
+    // Adds the sums of a pass of samples_added samples per pixel.
+    void add_pass(const framebuffer& pass_sums, int samples_added) {
+        for (size_t p = 0; p < pass_sums.size(); p++) {
+            sums[3*p]   += float(pass_sums[p].x());
+            sums[3*p+1] += float(pass_sums[p].y());
+            sums[3*p+2] += float(pass_sums[p].z());
+        }
+        samples += samples_added;
+    }
+
+    // Mean colour of each pixel's samples so far.
+    void resolve(framebuffer& image) const {
+        double scale = samples > 0 ? 1.0 / samples : 0.0;
+        for (size_t p = 0; p < image.size(); p++)
+            image[p] = scale * color(sums[3*p], sums[3*p+1], sums[3*p+2]);
+    }
+
+
+    // Writes a checkpoint to path. It is written to a temporary file that then replaces path, so an interrupted
+    // save leaves the previous checkpoint intact. Returns false if it could not be written.
+    bool save(const std::string& path) const {
+
+        std::string temp_path = path + ".tmp";
+        FILE* file = std::fopen(temp_path.c_str(), "wb");
+        if (!file)
+            return false;
+
+        checkpoint_header header = make_header();
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+               && std::fwrite(sums.data(), sizeof(float), sums.size(), file) == sums.size();
+        ok = (std::fclose(file) == 0) && ok;
+
+        return ok && std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    // Loads a checkpoint from path. Returns false (leaving the buffer unchanged) if there is no checkpoint, or if it
+    // is unreadable or was made for an image of a different size or with a different key; error then says which
+    // (and is left empty if there is simply no checkpoint).
+    bool load(const std::string& path, std::string& error) {
+
+        error.clear();
+        FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+
+        checkpoint_header header;
+        checkpoint_header expected = make_header();
+        std::vector<float> loaded(sums.size());
+
+        bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+               && std::memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0
+               && header.version == expected.version
+               && header.width == expected.width
+               && header.height == expected.height;
+        if (!ok) {
+            std::fclose(file);
+            error = "it is not a checkpoint of an image of this size";
+            return false;
+        }
+        if (header.key != expected.key) {
+            std::fclose(file);
+            error = "it was rendered from a different scene or with different settings";
+            return false;
+        }
+
+        ok = std::fread(loaded.data(), sizeof(float), loaded.size(), file) == loaded.size();
+        std::fclose(file);
+        if (!ok) {
+            error = "it is truncated";
+            return false;
+        }
+
+        sums.swap(loaded);
+        samples = int(header.samples);
+        return true;
+    }
+
+
+  private:
+
+    // Start of a checkpoint file, followed by the sums (native byte order).
+    struct checkpoint_header {
+        char     magic[8];          // "RTWACCUM"
+        uint32_t version;
+        int32_t  width;
+        int32_t  height;
+        int32_t  samples;           // Samples per pixel in the sums
+        uint64_t key;               // Key of the scene and render settings (see camera::render_key())
+    };
+
+    int width;
+    int height;
+    uint64_t key;                   // Key of the scene and render settings the samples are taken with
+    int samples;                    // Samples added to every pixel so far
+    std::vector<float> sums;        // Sum of the samples of each pixel, 3 channels per pixel in scanline order
+
+    checkpoint_header make_header() const {
+        checkpoint_header header;
+        std::memcpy(header.magic, "RTWACCUM", sizeof(header.magic));
+        header.version = 2;
+        header.width = width;
+        header.height = height;
+        header.samples = samples;
+        header.key = key;
+        return header;
+    }
+};
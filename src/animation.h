@@ -0,0 +1,98 @@
+#pragma once
+
+#include "camera.h"
+#include "image_writer.h"
+#include "render_stats.h"
+#include "sphere_set.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// The camera's view at one moment of an animation. Between keys, the view is interpolated linearly.
+struct camera_key {
+    double time;
+    point3 lookfrom;
+    point3 lookat;
+    double vfov;
+};
+
+
+// Renders a sequence of frames of a sphere_set scene in one process. Frame k shows the scene from time
+// start_time + k * frame_time, with the shutter open for the fraction shutter of the frame, so that moving spheres are
+// blurred over that part of their path.
+//
+// The scene is set up once for the whole sequence: the spheres, their materials and their BVH are reused by every
+// frame. If no sphere moves, the BVH is used as it was built; otherwise its boxes are refitted to each frame's shutter
+// interval (see sphere_set::refit()) rather than the tree being built again.
+class animation {
+
+  public:
+
+    int    frame_count  = 1;
+    double start_time   = 0;        // Time at which the shutter opens for the first frame
+    double frame_time   = 1;        // Time from one frame to the next
+    double shutter      = 0.5;      // Fraction of frame_time for which the shutter is open
+    std::string file_pattern = "frame_%04d";   // printf() pattern of a frame's file name, given its number (the camera's output_format adds the extension)
+    std::vector<camera_key> camera_path;       // Keys of the camera's view, in order of time (if empty, the camera's own view is kept)
+
+
+    void add_key(double time, const point3& lookfrom, const point3& lookat, double vfov) {
+        camera_path.push_back(camera_key{time, lookfrom, lookat, vfov});
+    }
+
+    // The view at time along camera_path (held at the first and last keys outside their times).
+    camera_key view_at(double time) const {
+        if (time <= camera_path.front().time)
+            return camera_path.front();
+
+        for (size_t k = 1; k < camera_path.size(); k++) {
+            const camera_key& a = camera_path[k-1];
+            const camera_key& b = camera_path[k];
+            if (time < b.time) {
+                double f = (time - a.time) / (b.time - a.time);
+                return camera_key{time, a.lookfrom + f * (b.lookfrom - a.lookfrom), a.lookat + f * (b.lookat - a.lookat),
+                                  a.vfov + f * (b.vfov - a.vfov)};
+            }
+        }
+        return camera_path.back();
+    }
+
+
+    // Renders the frames of world (whose spheres are in spheres) with cam, writing each to its own file.
+    void render(camera& cam, sphere_set& spheres, const hittable& world) const {
+
+        for (int frame = 0; frame < frame_count; frame++) {
+
+            cam.shutter_open  = start_time + frame * frame_time;
+            cam.shutter_close = cam.shutter_open + shutter * frame_time;
+
+            // The camera holds still while the shutter is open, at its place half way through.
+            if (!camera_path.empty()) {
+                camera_key view = view_at(0.5 * (cam.shutter_open + cam.shutter_close));
+                cam.lookfrom = view.lookfrom;
+                cam.lookat   = view.lookat;
+                cam.vfov     = view.vfov;
+            }
+
+            {
+                render_stats::phase_scope phase("bvh refit");
+                spheres.refit(cam.shutter_open, cam.shutter_close);
+            }
+
+            cam.output_file = file_name(frame) + image_writer::file_extension(cam.output_format);
+            std::clog << "\rFrame " << frame + 1 << " of " << frame_count << ": " << cam.output_file << "          \n";
+            cam.render(world);
+        }
+    }
+
+
+  private:
+
+    std::string file_name(int frame) const {
+        std::vector<char> name(file_pattern.size() + 32);
+        std::snprintf(name.data(), name.size(), file_pattern.c_str(), frame);
+        return std::string(name.data());
+    }
+};
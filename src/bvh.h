@@ -3,6 +3,7 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "render_stats.h"
 
 #include <algorithm>            // Access to sort() function.
 
@@ -70,6 +71,8 @@ class bvh_node : public hittable {
     // Must look at both left and right: Even if left hits, right might hit again but closer.
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
 
+        RTW_STAT(node_visits, 1);
+
         // Return false if ray does not intersect this node's bounding box
         if (!bbox.hit(r, ray_t))
             return false;
@@ -0,0 +1,628 @@
+#pragma once
+
+#include "aabb.h"
+
+#include <algorithm>            // Access to nth_element() and stable_partition() functions.
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <thread>
+#include <vector>
+
+
+// A node of a linear (flattened) BVH. Nodes are stored depth-first in one contiguous array, so the first child of
+// an interior node is always the next node in the array and only the index of the second child needs storing.
+// The bounds are single precision, rounded outwards, so that a node fits in 32 bytes (two nodes per cache line).
+struct linear_bvh_node {
+    float    bounds_min[3];     // Minimum x,y,z of the node's bounding box
+    float    bounds_max[3];     // Maximum x,y,z of the node's bounding box
+    uint32_t offset;            // Leaf: index of first primitive. Interior: index of second child.
+    uint16_t count;             // Number of primitives in a leaf (0 for an interior node)
+    uint8_t  axis;              // Axis the interior node was split along: 0 (x), 1 (y), 2 (z)
+    uint8_t  pad;
+
+    bool is_leaf() const { return count > 0; }
+
+    // The node's box in double precision.
+    aabb bounds() const {
+        return aabb(interval(bounds_min[0], bounds_max[0]),
+                    interval(bounds_min[1], bounds_max[1]),
+                    interval(bounds_min[2], bounds_max[2]));
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+
+// How to choose where an interior node's primitives are divided between its two children.
+enum class bvh_split_method {
+    median,     // Longest axis of the node's box, at the median primitive (as bvh_node does)
+    sah         // Binned surface area heuristic: the split (over all three axes) with the lowest expected ray cost
+};
+
+
+struct bvh_build_options {
+    bvh_split_method split = bvh_split_method::median;
+    int    max_leaf_size  = 2;          // Most primitives in a leaf (the SAH may stop splitting before this)
+    int    sah_bins       = 16;         // Number of bins per axis that the SAH evaluates splits between
+    double traversal_cost = 1.0;        // Cost of visiting an interior node, relative to intersecting one primitive
+    int    num_threads    = 0;          // Threads used to build large trees (0 = all hardware threads, 1 = serial)
+};
+
+
+// Expected cost of tracing a ray through a linear BVH, relative to one primitive intersection (the surface area
+// heuristic). Each node contributes its cost scaled by the probability (area ratio) that a ray hitting the root also
+// hits the node. Lower is better; used to compare trees made by different builders.
+inline double bvh_sah_cost(const linear_bvh_node* nodes, size_t node_count, double traversal_cost) {
+    if (node_count == 0)
+        return 0;
+
+    double root_area = nodes[0].bounds().surface_area();
+    if (root_area <= 0)
+        return 0;
+
+    double cost = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        const linear_bvh_node& node = nodes[i];
+        double node_cost = node.is_leaf() ? double(node.count) : traversal_cost;
+        cost += node_cost * node.bounds().surface_area() / root_area;
+    }
+    return cost;
+}
+
+inline double bvh_sah_cost(const std::vector<linear_bvh_node>& nodes, double traversal_cost) {
+    return bvh_sah_cost(nodes.data(), nodes.size(), traversal_cost);
+}
+
+
+// Builds a linear BVH over a set of bounding boxes. The builder reorders an index list rather than the primitives
+// themselves: a leaf's primitives are indices[offset] ... indices[offset+count-1].
+//
+// Large builds run in parallel. Near the root, where a few nodes each cover millions of primitives, the passes over a
+// node's primitives (bounding and SAH binning) are split into chunks on separate threads. Further down, the second
+// child's subtree is built as a separate task into its own node array, which is spliced in after the first child's.
+// Every reduction is exact (box unions and counts), so the tree is the same for any number of threads.
+class bvh_builder {
+
+  public:
+
+    std::vector<linear_bvh_node> nodes;     // Depth-first flattened tree (nodes[0] is the root)
+    std::vector<uint32_t> indices;          // Primitive indices in leaf order
+    aabb bounds;                            // Bounding box of all primitives
+
+
+    bvh_builder(const std::vector<aabb>& boxes, const bvh_build_options& options) :
+      boxes(boxes),
+      options(options)
+    {
+        this->options.max_leaf_size = std::max(1, std::min(options.max_leaf_size, int(std::numeric_limits<uint16_t>::max())));
+        this->options.sah_bins = std::max(2, options.sah_bins);
+
+        if (this->options.num_threads <= 0) {
+            unsigned int hardware_threads = std::thread::hardware_concurrency();
+            this->options.num_threads = hardware_threads > 0 ? int(hardware_threads) : 1;
+        }
+
+        // Spawn subtree tasks down to a depth that gives a few tasks per thread.
+        task_depth = 0;
+        if (this->options.num_threads > 1)
+            while ((1 << task_depth) < 4*this->options.num_threads)
+                task_depth++;
+
+        indices.resize(boxes.size());
+        for (size_t i = 0; i < boxes.size(); i++)
+            indices[i] = uint32_t(i);
+
+        if (boxes.empty())
+            return;
+
+        nodes.reserve(2*boxes.size());
+        build(nodes, 0, boxes.size(), 0);
+    }
+
+
+    // Converts a double precision box to the single precision node box that encloses it.
+    static linear_bvh_node make_node(const aabb& box) {
+        linear_bvh_node node;
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds_min[axis] = round_down(box.axis_interval(axis).min);
+            node.bounds_max[axis] = round_up(box.axis_interval(axis).max);
+        }
+        node.offset = 0;
+        node.count  = 0;
+        node.axis   = 0;
+        node.pad    = 0;
+        return node;
+    }
+
+
+  private:
+
+    // Below this depth the SAH gives way to median splits, which bound the remaining depth by log2 of the
+    // primitive count. Keeps even pathological scenes within a traversal stack of 64 entries.
+    static const int max_sah_depth = 32;
+
+    static const size_t min_task_span  = 4096;       // Smallest subtree worth building as a separate task
+    static const size_t min_chunk_span = 65536;      // Smallest pass over primitives worth splitting between threads
+
+    const std::vector<aabb>& boxes;
+    bvh_build_options options;
+    int task_depth;                                  // Subtrees above this depth may be built as separate tasks
+
+
+    // Recursively builds the subtree for indices[start, end), appending its nodes depth-first to out. Returns the
+    // index of the subtree's root in out.
+    uint32_t build(std::vector<linear_bvh_node>& out, size_t start, size_t end, int depth) {
+
+        aabb span_box = reduce<aabb>(start, end, depth,
+            [&](size_t first, size_t last) {
+                aabb box = aabb::empty;
+                for (size_t i = first; i < last; i++)
+                    box = aabb(box, boxes[indices[i]]);
+                return box;
+            },
+            [](const aabb& a, const aabb& b) { return aabb(a, b); });
+
+        if (depth == 0)
+            bounds = span_box;
+
+        uint32_t node_index = uint32_t(out.size());
+        out.push_back(make_node(span_box));
+
+        int axis = 0;
+        size_t mid = (options.split == bvh_split_method::sah && depth < max_sah_depth)
+                   ? split_sah(start, end, depth, span_box, axis)
+                   : split_median(start, end, depth, span_box, axis);
+
+        if (mid == start) {
+            out[node_index].offset = uint32_t(start);
+            out[node_index].count  = uint16_t(end - start);
+            return node_index;
+        }
+
+        uint32_t second;
+        if (depth < task_depth && end - mid >= min_task_span) {
+
+            // Build the second subtree concurrently, into its own array (the two spans of indices don't overlap).
+            auto second_task = std::async(std::launch::async, [this, mid, end, depth]() {
+                std::vector<linear_bvh_node> subtree;
+                subtree.reserve(2*(end - mid));
+                build(subtree, mid, end, depth+1);
+                return subtree;
+            });
+
+            build(out, start, mid, depth+1);                        // First child is the next node
+            std::vector<linear_bvh_node> subtree = second_task.get();
+
+            // Append the second subtree, moving its interior nodes' child indices along by its new position.
+            second = uint32_t(out.size());
+            for (auto node : subtree) {
+                if (!node.is_leaf())
+                    node.offset += second;
+                out.push_back(node);
+            }
+
+        } else {
+            build(out, start, mid, depth+1);                        // First child is the next node
+            second = build(out, mid, end, depth+1);
+        }
+
+        out[node_index].offset = second;
+        out[node_index].axis   = uint8_t(axis);
+        return node_index;
+    }
+
+
+    // Number of chunks to split a pass over [start, end) into: large spans are split between threads (fewer with
+    // depth, as the subtree tasks at that depth share the threads); smaller spans are done in one go.
+    size_t chunk_count(size_t start, size_t end, int depth) const {
+        return (end - start >= min_chunk_span && depth < 31) ? size_t(options.num_threads >> depth) : 1;
+    }
+
+    // Runs fn(c, first, last) for each of n_chunks chunks of [start, end), the first on the calling thread and the rest
+    // on threads of their own. Returns once all are done.
+    template <typename chunk_fn>
+    static void for_each_chunk(size_t start, size_t end, size_t n_chunks, chunk_fn fn) {
+        size_t span = end - start;
+        std::vector<std::future<void>> chunks;
+        for (size_t c = 1; c < n_chunks; c++)
+            chunks.push_back(std::async(std::launch::async, fn, c, start + span*c/n_chunks, start + span*(c+1)/n_chunks));
+
+        fn(size_t(0), start, start + span/n_chunks);
+        for (auto& chunk : chunks)
+            chunk.get();
+    }
+
+    // Applies map(first, last) to chunks of [start, end) and combines the results in order (see chunk_count()).
+    template <typename T, typename map_fn, typename combine_fn>
+    T reduce(size_t start, size_t end, int depth, map_fn map, combine_fn combine) const {
+
+        size_t n_chunks = chunk_count(start, end, depth);
+        if (n_chunks <= 1)
+            return map(start, end);
+
+        std::vector<T> results(n_chunks);
+        for_each_chunk(start, end, n_chunks, [&](size_t c, size_t first, size_t last) { results[c] = map(first, last); });
+
+        T result = results[0];
+        for (size_t c = 1; c < n_chunks; c++)
+            result = combine(result, results[c]);
+        return result;
+    }
+
+
+    // Moves the indices in [start, end) for which goes_first(index) is true in front of the others, keeping the order
+    // within each group, and returns the position of the first of the others. Large spans are partitioned in chunks on
+    // separate threads: each chunk counts its indices that go first, which gives every chunk the places its indices
+    // go to, and then the chunks scatter their indices into a buffer at the same time. The result is the same for any
+    // number of threads, as the partition is stable.
+    template <typename pred_fn>
+    size_t partition(size_t start, size_t end, int depth, pred_fn goes_first) {
+
+        size_t n_chunks = chunk_count(start, end, depth);
+        if (n_chunks <= 1)
+            return size_t(std::stable_partition(indices.begin() + start, indices.begin() + end, goes_first) - indices.begin());
+
+        std::vector<size_t> first_count(n_chunks), chunk_size(n_chunks);
+        for_each_chunk(start, end, n_chunks, [&](size_t c, size_t first, size_t last) {
+            size_t count = 0;
+            for (size_t i = first; i < last; i++)
+                count += goes_first(indices[i]) ? 1 : 0;
+            first_count[c] = count;
+            chunk_size[c] = last - first;
+        });
+
+        // Where each chunk's indices that go first, and its others, start in the partitioned span.
+        size_t total_first = 0;
+        for (size_t c = 0; c < n_chunks; c++)
+            total_first += first_count[c];
+
+        std::vector<size_t> first_place(n_chunks), other_place(n_chunks);
+        size_t n_first = 0, n_other = 0;
+        for (size_t c = 0; c < n_chunks; c++) {
+            first_place[c] = n_first;
+            other_place[c] = total_first + n_other;
+            n_first += first_count[c];
+            n_other += chunk_size[c] - first_count[c];
+        }
+
+        std::vector<uint32_t> partitioned(end - start);
+        for_each_chunk(start, end, n_chunks, [&](size_t c, size_t first, size_t last) {
+            size_t f = first_place[c], o = other_place[c];
+            for (size_t i = first; i < last; i++)
+                partitioned[goes_first(indices[i]) ? f++ : o++] = indices[i];
+        });
+        for_each_chunk(start, end, n_chunks, [&](size_t, size_t first, size_t last) {
+            std::copy(partitioned.begin() + (first - start), partitioned.begin() + (last - start), indices.begin() + first);
+        });
+
+        return start + total_first;
+    }
+
+
+    // The index in [start, end) that would be rank'th (from 0) if they were sorted by key(index), ties being broken by
+    // the index itself. Large spans are searched in chunks on separate threads: a histogram of the keys narrows down
+    // the range of keys the index is in, until few enough indices are left in it to pick the index from them directly.
+    template <typename key_fn>
+    uint32_t select(size_t start, size_t end, int depth, size_t rank, key_fn key) const {
+
+        auto before = [&](uint32_t a, uint32_t b) { return key(a) < key(b) || (key(a) == key(b) && a < b); };
+
+        std::vector<uint32_t> candidates;
+        if (chunk_count(start, end, depth) <= 1) {
+            candidates.assign(indices.begin() + start, indices.begin() + end);
+        } else {
+            const int n_bins = 1024;
+            struct key_bin {
+                size_t count;
+                real min, max;
+            };
+
+            real lo = -real(infinity), hi = real(infinity);     // Range of keys the index is in
+            for (int pass = 0; pass < 8; pass++) {
+
+                // The range is first found from the keys themselves.
+                interval range = reduce<interval>(start, end, depth,
+                    [&](size_t first, size_t last) {
+                        interval r = interval::empty;
+                        for (size_t i = first; i < last; i++) {
+                            real k = key(indices[i]);
+                            if (lo <= k && k <= hi)
+                                r = interval(std::min(r.min, k), std::max(r.max, k));
+                        }
+                        return r;
+                    },
+                    [](const interval& a, const interval& b) { return interval(a, b); });
+                if (range.size() <= 0)
+                    break;
+
+                std::vector<key_bin> bins = reduce<std::vector<key_bin>>(start, end, depth,
+                    [&](size_t first, size_t last) {
+                        std::vector<key_bin> chunk_bins(n_bins, key_bin{0, real(infinity), -real(infinity)});
+                        for (size_t i = first; i < last; i++) {
+                            real k = key(indices[i]);
+                            if (k < range.min || k > range.max)
+                                continue;
+                            key_bin& b = chunk_bins[bin_index(k, range, n_bins)];
+                            b.count++;
+                            b.min = std::min(b.min, k);
+                            b.max = std::max(b.max, k);
+                        }
+                        return chunk_bins;
+                    },
+                    [](std::vector<key_bin> a, const std::vector<key_bin>& b) {
+                        for (size_t k = 0; k < a.size(); k++)
+                            a[k] = key_bin{a[k].count + b[k].count, std::min(a[k].min, b[k].min), std::max(a[k].max, b[k].max)};
+                        return a;
+                    });
+
+                // Keys below the range have been counted off rank already; find the bin the rank'th index is in.
+                int b = 0;
+                while (rank >= bins[b].count) {
+                    rank -= bins[b].count;
+                    b++;
+                }
+                lo = bins[b].min;
+                hi = bins[b].max;
+                if (bins[b].count <= min_chunk_span)
+                    break;
+            }
+
+            candidates = reduce<std::vector<uint32_t>>(start, end, depth,
+                [&](size_t first, size_t last) {
+                    std::vector<uint32_t> found;
+                    for (size_t i = first; i < last; i++) {
+                        real k = key(indices[i]);
+                        if (lo <= k && k <= hi)
+                            found.push_back(indices[i]);
+                    }
+                    return found;
+                },
+                [](std::vector<uint32_t> a, const std::vector<uint32_t>& b) {
+                    a.insert(a.end(), b.begin(), b.end());
+                    return a;
+                });
+        }
+
+        std::nth_element(candidates.begin(), candidates.begin() + rank, candidates.end(), before);
+        return candidates[rank];
+    }
+
+
+    // Returns the index at which to split indices[start, end), or start if the span should become a leaf.
+    size_t split_median(size_t start, size_t end, int depth, const aabb& span_box, int& axis) {
+
+        size_t object_span = end - start;
+        if (object_span <= size_t(options.max_leaf_size))
+            return start;
+
+        axis = span_box.longest_axis();
+
+        // Put the lower half (by the box minimum along the axis) first.
+        auto key = [&](uint32_t i) { return boxes[i].axis_interval(axis).min; };
+        uint32_t median = select(start, end, depth, object_span/2, key);
+        real median_key = key(median);
+
+        return partition(start, end, depth, [&](uint32_t i) {
+            return key(i) < median_key || (key(i) == median_key && i < median);
+        });
+    }
+
+
+    // Bins the primitives by box centroid along each axis and evaluates the SAH cost of splitting between every
+    // pair of adjacent bins. Returns the index at which to split, or start if a leaf is cheaper than any split.
+    size_t split_sah(size_t start, size_t end, int depth, const aabb& span_box, int& axis) {
+
+        size_t object_span = end - start;
+        if (object_span == 1)
+            return start;
+
+        double parent_area = span_box.surface_area();
+
+        aabb centroid_box = reduce<aabb>(start, end, depth,
+            [&](size_t first, size_t last) {
+                aabb box = aabb::empty;
+                for (size_t i = first; i < last; i++) {
+                    auto c = centroid(boxes[indices[i]]);
+                    box = aabb(box, aabb(c, c));
+                }
+                return box;
+            },
+            [](const aabb& a, const aabb& b) { return aabb(a, b); });
+
+        // Bin the primitives along all three axes in one pass over them: bins[a*n_bins + k] is bin k of axis a.
+        const int n_bins = options.sah_bins;
+        std::vector<bin> bins = reduce<std::vector<bin>>(start, end, depth,
+            [&](size_t first, size_t last) {
+                std::vector<bin> chunk_bins(3*n_bins, bin{aabb::empty, 0});
+                for (size_t i = first; i < last; i++) {
+                    const aabb& box = boxes[indices[i]];
+                    auto c = centroid(box);
+                    for (int a = 0; a < 3; a++) {
+                        const interval& extent = centroid_box.axis_interval(a);
+                        if (extent.size() <= 0)
+                            continue;
+                        bin& b = chunk_bins[a*n_bins + bin_index(c[a], extent, n_bins)];
+                        b.box = aabb(b.box, box);
+                        b.count++;
+                    }
+                }
+                return chunk_bins;
+            },
+            [](std::vector<bin> a, const std::vector<bin>& b) {
+                for (size_t k = 0; k < a.size(); k++)
+                    a[k] = bin{aabb(a[k].box, b[k].box), a[k].count + b[k].count};
+                return a;
+            });
+
+        std::vector<double> right_area(n_bins);
+        std::vector<size_t> right_count(n_bins);
+
+        double best_cost = infinity;
+        int best_axis = -1;
+        int best_split = 0;         // Bins [0, best_split) go to the first child
+
+        for (int a = 0; a < 3 && parent_area > 0; a++) {
+
+            if (centroid_box.axis_interval(a).size() <= 0)
+                continue;           // All centroids coincide along this axis
+
+            const bin* axis_bins = &bins[a*n_bins];
+
+            // Sweep from the right to get the area and count of everything right of each bin boundary...
+            aabb accumulated = aabb::empty;
+            size_t count = 0;
+            for (int k = n_bins - 1; k > 0; k--) {
+                accumulated = aabb(accumulated, axis_bins[k].box);
+                count += axis_bins[k].count;
+                right_area[k] = accumulated.surface_area();
+                right_count[k] = count;
+            }
+
+            // ...then from the left, evaluating the cost of splitting at each boundary.
+            accumulated = aabb::empty;
+            count = 0;
+            for (int k = 1; k < n_bins; k++) {
+                accumulated = aabb(accumulated, axis_bins[k-1].box);
+                count += axis_bins[k-1].count;
+                if (count == 0 || right_count[k] == 0)
+                    continue;
+
+                double cost = options.traversal_cost
+                            + (accumulated.surface_area()*count + right_area[k]*right_count[k]) / parent_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_split = k;
+                }
+            }
+        }
+
+        // No usable split (e.g., every centroid is in the same place): fall back to the median.
+        if (best_axis < 0)
+            return split_median(start, end, depth, span_box, axis);
+
+        // A leaf costs one intersection per primitive.
+        if (object_span <= size_t(options.max_leaf_size) && double(object_span) <= best_cost)
+            return start;
+
+        axis = best_axis;
+        const interval& extent = centroid_box.axis_interval(axis);
+        return partition(start, end, depth, [&](uint32_t i) {
+            return bin_index(centroid(boxes[i])[axis], extent, n_bins) < best_split;
+        });
+    }
+
+
+    // Primitives whose box centroids fall in one SAH bin, and the box enclosing them.
+    struct bin {
+        aabb box;
+        size_t count;
+    };
+
+    static point3 centroid(const aabb& box) {
+        return point3(0.5*(box.x.min + box.x.max), 0.5*(box.y.min + box.y.max), 0.5*(box.z.min + box.z.max));
+    }
+
+    static int bin_index(double c, const interval& extent, int n_bins) {
+        int k = int(n_bins * (c - extent.min) / extent.size());
+        return k < 0 ? 0 : (k >= n_bins ? n_bins - 1 : k);
+    }
+
+    static float round_down(double x) {
+        float f = float(x);
+        return (double(f) > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float round_up(double x) {
+        float f = float(x);
+        return (double(f) < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+
+
+// Recomputes the boxes of a linear BVH after its primitives have moved, keeping the structure of the tree.
+// leaf_box(first, count) returns the box of a leaf's primitives. A node's children always come after it in the array
+// (the first child is the next node), so a pass from the back visits every child before its parent.
+//
+// Large trees are refitted with num_threads threads (0 = all hardware threads), so leaf_box must then be safe to call
+// concurrently. The subtrees below the top few levels are refitted at the same time (each subtree is a contiguous run
+// of nodes, so each is a pass from the back of its own run), and then the few nodes above them.
+template <typename leaf_box_fn>
+inline void refit_linear_bvh(linear_bvh_node* nodes, size_t node_count, leaf_box_fn leaf_box, int num_threads = 1) {
+
+    auto refit_node = [&](size_t k) {
+        linear_bvh_node& node = nodes[k];
+
+        if (node.is_leaf()) {
+            linear_bvh_node box = bvh_builder::make_node(leaf_box(node.offset, uint32_t(node.count)));
+            std::copy(box.bounds_min, box.bounds_min + 3, node.bounds_min);
+            std::copy(box.bounds_max, box.bounds_max + 3, node.bounds_max);
+            return;
+        }
+
+        // The children's boxes are already rounded outwards, so their union needs no further rounding.
+        const linear_bvh_node& first  = nodes[k + 1];
+        const linear_bvh_node& second = nodes[node.offset];
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds_min[axis] = std::min(first.bounds_min[axis], second.bounds_min[axis]);
+            node.bounds_max[axis] = std::max(first.bounds_max[axis], second.bounds_max[axis]);
+        }
+    };
+
+    if (num_threads <= 0) {
+        unsigned int hardware_threads = std::thread::hardware_concurrency();
+        num_threads = hardware_threads > 0 ? int(hardware_threads) : 1;
+    }
+
+    const size_t min_parallel_nodes = 16384;        // Smallest tree worth refitting with several threads
+    if (num_threads == 1 || node_count < min_parallel_nodes) {
+        for (size_t k = node_count; k-- > 0; )
+            refit_node(k);
+        return;
+    }
+
+    // Split the top of the tree into about four subtrees per thread.
+    std::vector<uint32_t> top;
+    std::vector<uint32_t> subtrees(1, 0);
+    while (subtrees.size() < size_t(4 * num_threads)) {
+        std::vector<uint32_t> next;
+        for (uint32_t root : subtrees) {
+            if (nodes[root].is_leaf()) {
+                next.push_back(root);
+                continue;
+            }
+            top.push_back(root);
+            next.push_back(root + 1);
+            next.push_back(nodes[root].offset);
+        }
+        if (next.size() == subtrees.size())
+            break;
+        subtrees.swap(next);
+    }
+
+    // A subtree's nodes run from its root to its last leaf, found by following the second children.
+    auto subtree_end = [nodes](uint32_t root) {
+        while (!nodes[root].is_leaf())
+            root = nodes[root].offset;
+        return size_t(root) + 1;
+    };
+
+    std::vector<std::future<void>> tasks;
+    for (int t = 0; t < num_threads; t++) {
+        tasks.push_back(std::async(std::launch::async, [&, t]() {
+            for (size_t s = size_t(t); s < subtrees.size(); s += size_t(num_threads))
+                for (size_t k = subtree_end(subtrees[s]); k-- > subtrees[s]; )
+                    refit_node(k);
+        }));
+    }
+    for (auto& task : tasks)
+        task.get();
+
+    // The nodes above the subtrees, children (which come later in the array) first.
+    std::sort(top.begin(), top.end());
+    for (auto k = top.rbegin(); k != top.rend(); ++k)
+        refit_node(*k);
+}
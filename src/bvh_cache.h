@@ -0,0 +1,312 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "sampler.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// A file mapped read-only into memory. Its pages are read from disk as they are first touched, and are shared by every
+// process that maps the same file, rather than each process holding its own copy. (Where mmap() is not available the
+// file is read into memory instead.)
+class mapped_file {
+
+  public:
+
+    explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            return;
+        buffer.resize(size_t(in.tellg()));
+        in.seekg(0);
+        if (!buffer.empty() && in.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(buffer.size()))) {
+            bytes = buffer.data();
+            length = buffer.size();
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapping = ::mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED) {
+                bytes = static_cast<const unsigned char*>(mapping);
+                length = size_t(info.st_size);
+            }
+        }
+        ::close(fd);            // The mapping stays valid after the file is closed
+#endif
+    }
+
+    ~mapped_file() {
+#ifndef _WIN32
+        if (bytes)
+            ::munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool is_open() const { return bytes != nullptr; }
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    std::vector<unsigned char> buffer;
+#endif
+};
+
+
+// Hash of everything that determines the BVH bvh_builder makes: the primitives' boxes, in order, and the build
+// options that shape the tree (the number of threads does not, see bvh_builder).
+inline uint64_t bvh_cache_key(const std::vector<aabb>& boxes, const bvh_build_options& options) {
+
+    uint64_t h = hash_seed;
+    hash_combine(h, uint64_t(options.split));
+    hash_combine(h, uint64_t(options.max_leaf_size));
+    hash_combine(h, uint64_t(options.sah_bins));
+    hash_double(h, options.traversal_cost);
+    hash_combine(h, uint64_t(boxes.size()));
+    for (const auto& box : boxes) {
+        for (int axis = 0; axis < 3; axis++) {
+            hash_double(h, box.axis_interval(axis).min);
+            hash_double(h, box.axis_interval(axis).max);
+        }
+    }
+    return h;
+}
+
+
+// A built linear BVH: its nodes (depth-first, as bvh_builder makes them), the order of the primitives in its leaves,
+// and its bounds. The tree is either built in memory or mapped from a cache file (see build()).
+class linear_bvh_tree {
+
+  public:
+
+    const linear_bvh_node* nodes() const { return file ? mapped_nodes : built_nodes.data(); }
+    size_t node_count() const { return file ? mapped_node_count : built_nodes.size(); }
+
+    // Primitive indices in leaf order: a leaf's primitives are indices()[offset] ... indices()[offset+count-1].
+    const uint32_t* indices() const { return file ? mapped_indices : built_indices.data(); }
+    size_t index_count() const { return file ? mapped_index_count : built_indices.size(); }
+
+    const aabb& bounds() const { return bbox; }
+
+    // Whether the tree was mapped from a cache file rather than built.
+    bool from_cache() const { return file != nullptr; }
+
+
+    // Recomputes the node boxes after the primitives have moved (see refit_linear_bvh()). A tree mapped from a cache
+    // file is first copied into memory of its own, as the mapping is read-only (and the file still describes the
+    // primitives as they were).
+    template <typename leaf_box_fn>
+    void refit(leaf_box_fn leaf_box, int num_threads = 1) {
+        make_own_copy();
+        refit_linear_bvh(built_nodes.data(), built_nodes.size(), leaf_box, num_threads);
+        bbox = built_nodes.empty() ? aabb() : built_nodes[0].bounds();
+    }
+
+
+    // Builds the tree over boxes with bvh_builder. If cache_dir is set, the tree is first looked for in cache_dir, in a
+    // file named after the bvh_cache_key() of boxes and options. If it is there the file is mapped rather than the tree
+    // built; if not, the tree is built and saved there for the next run.
+    static linear_bvh_tree build(const std::vector<aabb>& boxes, const bvh_build_options& options,
+                                 const std::string& cache_dir = std::string()) {
+        linear_bvh_tree tree;
+
+        std::string path;
+        uint64_t key = 0;
+        if (!cache_dir.empty()) {
+            key = bvh_cache_key(boxes, options);
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+            path = cache_dir + "/" + name;
+            if (tree.map(path, key, boxes.size()))
+                return tree;
+        }
+
+        bvh_builder builder(boxes, options);
+        tree.built_nodes.swap(builder.nodes);
+        tree.built_indices.swap(builder.indices);
+        tree.bbox = builder.bounds;
+
+        if (!path.empty() && !tree.save(path, key))
+            std::cerr << "Could not write BVH cache file " << path << '\n';
+        return tree;
+    }
+
+
+  private:
+
+    static const uint32_t cache_version = 1;
+
+    // Start of a cache file, followed by the nodes and then the indices (native byte order).
+    struct cache_header {
+        char     magic[8];          // "RTWBVHC1"
+        uint32_t version;
+        uint32_t node_size;         // sizeof(linear_bvh_node), so that a file made with another node layout is not used
+        uint64_t key;               // bvh_cache_key() of the boxes and options the tree was built from
+        uint64_t node_count;
+        uint64_t index_count;
+        double   bounds[6];         // Min and max of the x, y and z intervals of the tree's bounds
+        uint8_t  pad[40];           // So that the nodes start on a cache line
+    };
+
+    static_assert(sizeof(cache_header) == 128, "cache_header should be 128 bytes");
+
+    std::vector<linear_bvh_node> built_nodes;
+    std::vector<uint32_t> built_indices;
+
+    std::shared_ptr<mapped_file> file;              // Set if the tree is mapped from a cache file
+    const linear_bvh_node* mapped_nodes = nullptr;
+    size_t mapped_node_count = 0;
+    const uint32_t* mapped_indices = nullptr;
+    size_t mapped_index_count = 0;
+
+    aabb bbox;
+
+
+    void make_own_copy() {
+        if (!file)
+            return;
+        built_nodes.assign(mapped_nodes, mapped_nodes + mapped_node_count);
+        built_indices.assign(mapped_indices, mapped_indices + mapped_index_count);
+        file.reset();
+    }
+
+    static cache_header make_header(uint64_t key) {
+        cache_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "RTWBVHC1", sizeof(header.magic));
+        header.version = cache_version;
+        header.node_size = sizeof(linear_bvh_node);
+        header.key = key;
+        return header;
+    }
+
+    // Maps the cache file at path, if it holds the tree for key (over primitives boxes). Returns false if it does not.
+    bool map(const std::string& path, uint64_t key, size_t primitives) {
+
+        auto mapped = std::make_shared<mapped_file>(path);
+        if (!mapped->is_open() || mapped->size() < sizeof(cache_header))
+            return false;
+
+        cache_header header;
+        std::memcpy(&header, mapped->data(), sizeof(header));
+        cache_header expected = make_header(key);
+        if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version
+            || header.node_size != expected.node_size || header.key != key || header.index_count != primitives
+            || mapped->size() != sizeof(cache_header) + header.node_count * sizeof(linear_bvh_node)
+                                                      + header.index_count * sizeof(uint32_t))
+            return false;
+
+        auto nodes = reinterpret_cast<const linear_bvh_node*>(mapped->data() + sizeof(cache_header));
+        auto indices = reinterpret_cast<const uint32_t*>(nodes + header.node_count);
+        if (!is_valid_tree(nodes, size_t(header.node_count), indices, size_t(header.index_count)))
+            return false;
+
+        file = mapped;
+        mapped_nodes = nodes;
+        mapped_node_count = size_t(header.node_count);
+        mapped_indices = indices;
+        mapped_index_count = size_t(header.index_count);
+        bbox = aabb(interval(header.bounds[0], header.bounds[1]),
+                    interval(header.bounds[2], header.bounds[3]),
+                    interval(header.bounds[4], header.bounds[5]));
+        return true;
+    }
+
+    // Whether a tree read from a file can be used as it is: every index is that of a primitive, and appears once;
+    // every node's children come after it in the array (so traversal cannot loop), every node but the root is the
+    // child of exactly one node (so it is a tree, and each node has a single depth), every leaf's primitives are among
+    // the indices, and the tree is no deeper than the traversal stack. A corrupt file, or one written by a changed
+    // builder, is then rebuilt rather than read out of bounds.
+    static bool is_valid_tree(const linear_bvh_node* nodes, size_t node_count, const uint32_t* indices, size_t index_count) {
+
+        std::vector<bool> seen(index_count, false);
+        for (size_t k = 0; k < index_count; k++) {
+            if (indices[k] >= index_count || seen[indices[k]])
+                return false;
+            seen[indices[k]] = true;
+        }
+
+        // Children come after their parents, so a node's depth is known (and it has been claimed by its parent) before
+        // it is reached.
+        std::vector<uint8_t> depth(node_count, 0);
+        std::vector<bool> has_parent(node_count, false);
+        for (size_t k = 0; k < node_count; k++) {
+            const linear_bvh_node& node = nodes[k];
+            if (k > 0 && !has_parent[k])
+                return false;
+            if (node.is_leaf()) {
+                if (size_t(node.offset) + node.count > index_count)
+                    return false;
+                continue;
+            }
+            if (k + 1 >= node_count || node.offset <= k + 1 || node.offset >= node_count || node.axis > 2
+                || depth[k] + 1 >= 64 || has_parent[k + 1] || has_parent[node.offset])
+                return false;
+            has_parent[k + 1] = has_parent[node.offset] = true;
+            depth[k + 1] = depth[node.offset] = uint8_t(depth[k] + 1);
+        }
+        return true;
+    }
+
+    // Saves the tree to path. It is written to a temporary file that then replaces path, so that other processes never
+    // map a partly written file.
+    bool save(const std::string& path, uint64_t key) const {
+
+#ifdef _WIN32
+        long long process = ::_getpid();
+#else
+        long long process = ::getpid();
+#endif
+        std::string temp_path = path + ".tmp" + std::to_string(process) + "-"
+                              + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+        FILE* out = std::fopen(temp_path.c_str(), "wb");
+        if (!out)
+            return false;
+
+        cache_header header = make_header(key);
+        header.node_count = built_nodes.size();
+        header.index_count = built_indices.size();
+        for (int axis = 0; axis < 3; axis++) {
+            header.bounds[2*axis]   = bbox.axis_interval(axis).min;
+            header.bounds[2*axis+1] = bbox.axis_interval(axis).max;
+        }
+
+        bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1
+               && std::fwrite(built_nodes.data(), sizeof(linear_bvh_node), built_nodes.size(), out) == built_nodes.size()
+               && std::fwrite(built_indices.data(), sizeof(uint32_t), built_indices.size(), out) == built_indices.size();
+        ok = (std::fclose(out) == 0) && ok;
+
+        if (ok && std::rename(temp_path.c_str(), path.c_str()) == 0)
+            return true;
+        std::remove(temp_path.c_str());
+        return false;
+    }
+};
@@ -1,7 +1,31 @@
 #pragma once
 
+#include "accumulation_buffer.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_writer.h"
 #include "material.h"
+#include "pixel_estimate.h"
+#include "render_farm.h"
+#include "render_stats.h"
+#include "russian_roulette.h"
+#include "sampler.h"
+#include "tile_scheduler.h"
+#include "wavefront.h"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How camera::render() follows the paths of light through the scene.
+enum class integrator_type {
+    recursive,      // One path at a time, to its end (camera::ray_color())
+    wavefront       // Batches of paths, one bounce at a time (wavefront_integrator)
+};
 
 class camera {
 
@@ -21,39 +45,119 @@ class camera {
     double defocus_angle      = 0;        // Variation angle of rays through each pixel
     double focus_dist         = 10;       // Distance from camera lookfrom point to plane of perfect focus
 
+    // motion blur
+    double shutter_open       = 0;        // Time at which the shutter opens (rays are fired at times spread over the shutter interval)
+    double shutter_close      = 1;        // Time at which the shutter closes
+
+    // Parallel rendering
+    int    num_threads        = 0;        // Number of render worker threads (0 = use all hardware threads)
+    int    tile_size          = 16;       // Width and height (in pixels) of the square tiles handed out to worker threads
+    bool   packet_tracing     = false;    // Trace the camera rays of neighbouring pixels together, in SIMD packets (recursive integrator only)
+    integrator_type integrator = integrator_type::recursive;     // Path tracer used to render the image
+    int    wavefront_paths    = 16384;    // Approximate number of paths traced together by the wavefront integrator
+
+    // Russian roulette path termination (see russian_roulette.h)
+    int    roulette_depth     = 3;        // Number of bounces before paths can be terminated at random (max_depth or more turns it off)
+    double roulette_min_survival = 0.05;  // Lowest probability of a path surviving a bounce
+
+    // Adaptive sampling: the image is rendered in passes and each pass only samples the pixels that are still noisy,
+    // spending a budget of samples_per_pixel samples per pixel on average where it is needed.
+    bool   adaptive_sampling  = false;    // Render with adaptive sampling (packet_tracing is not used in this mode)
+    int    adaptive_min_spp   = 16;       // Number of samples every pixel receives (in the first pass)
+    int    adaptive_max_spp   = 1024;     // Largest number of samples any pixel receives
+    double adaptive_threshold = 0.05;     // A pixel is done when its 95% confidence interval is within this fraction of its brightness
+    std::string sample_count_file;        // If set, a (PGM) image of the number of samples taken in each pixel is written here
+
+    // Progressive rendering: samples are added to the image in passes, so that it can be watched as it renders, and
+    // the render can be stopped and resumed from a checkpoint.
+    bool   progressive        = false;    // Render progressively (adaptive_sampling is not used in this mode)
+    int    progressive_pass_spp = 16;     // Number of samples added to every pixel in each pass
+    std::string progressive_image_file;   // If set, the image so far is written here after every pass
+    std::string checkpoint_file;          // If set, progress is saved here after every pass, and rendering resumes from it
+
+    // Distributed rendering: tiles are handed out to worker processes, which send back their pixels (see render_farm.h).
+    // Not used with adaptive_sampling, which renders in this process.
+    int    farm_workers       = 0;        // Number of local worker processes to start (0 = render in this process)
+    int    farm_port          = 0;        // If set, workers on other machines can also join the render on this TCP port
+    double farm_tile_timeout  = 60;       // Seconds a worker may take over a tile before it is dropped as lost (0 = no limit)
+    uint64_t scene_key        = 0;        // Hash of the scene (scene_description::content_key()): workers must have loaded the same one
+
+    // Output
+    image_format output_format = image_format::ppm;     // File format of the rendered image
+    std::string output_file;              // File the rendered image is written to (standard output if not set)
+
+    // Instrumentation (only in builds with RTW_STATS, see render_stats.h)
+    std::string stats_heatmap_file;       // If set, the traversal cost of each pixel is written here as a heatmap
+
 
 
     void render(const hittable& world) {
 
+        framebuffer image = render_image(world);
+
+        // Write the average colour of ray samples to file (once all tiles are done)
+        {
+            render_stats::phase_scope phase("write");
+            if (output_file.empty())
+                image_writer::write(std::cout, image, output_format);
+            else if (!image_writer::write(output_file, image, output_format))
+                std::cerr << "\nCould not write image " << output_file << '\n';
+        }
+
+        std::clog << "\rDone.                                        \n";
+
+        if (render_stats::enabled) {
+            render_stats::report(std::clog);
+            if (!stats_heatmap_file.empty())
+                write_stats_heatmap();
+        }
+    }
+
+
+    // Renders the image of world and returns it, without writing it out.
+    framebuffer render_image(const hittable& world) {
+
         // Set up the camera parameters
         initialize();
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        // Every pixel sample seeds its own random numbers (see sampler.h), so the image is identical whatever the number of threads.
+        framebuffer image(image_width, image_height);
 
-        for (int j = 0; j < image_height; j++) {
+        render_stats::begin_render(image_width, image_height);
+        render_stats::phase_scope phase("render");
 
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
+        if ((farm_workers > 0 || farm_port > 0) && !adaptive_sampling)
+            start_farm(world);
 
-            for (int i = 0; i < image_width; i++) {
+        if (progressive)
+            render_progressive(world, image);
+        else if (adaptive_sampling)
+            render_adaptive(world, image);
+        else
+            render_fixed(world, image);
 
-                // Will be used to hold the average colour of samples_per_pixel sampled rays
-                color pixel_color(0,0,0);
+        farm.reset();           // Lets the workers go
+        return image;
+    }
 
-                for (int sample = 0; sample < samples_per_pixel; sample++) {
 
-                  // Get a ray that points at through a random point in the current pixel's space.
-                  ray r = get_ray(i, j);
+    // Renders as a worker for the coordinator at address ("host:port", see farm_port), until the coordinator has
+    // finished. The worker must have the same scene and camera settings as the coordinator (it is turned away if not),
+    // and renders with num_threads threads. Returns false if the coordinator could not be reached or went away.
+    bool serve(const hittable& world, const std::string& address) {
 
-                  // Get the colour of the current ray and add it to the colour sum (will be averaged later)
-                  pixel_color += ray_color(r, max_depth, world);
-                }
+        initialize();
 
-                // Write the average colour of ray samples to file
-                write_color(std::cout, pixel_samples_scale * pixel_color);
-            }
+        int fd = render_farm::connect_to(address);
+        if (fd < 0) {
+            std::cerr << "Could not connect to " << address << '\n';
+            return false;
         }
 
-        std::clog << "\rDone.                 \n";
+        return render_farm::serve(fd, render_key(world), worker_count(), image_width, image_height,
+            [&](const tile& t, int sample0, int sample1, double scale, framebuffer& image) {
+                render_tile_samples(t, world, sample0, sample1, scale, image);
+            });
     }
 
 
@@ -70,6 +174,442 @@ class camera {
     vec3   defocus_disk_u;        // Defocus disk radius projected in u-direction
     vec3   defocus_disk_v;        // Defocus disk radius projected in v-direction
 
+    std::shared_ptr<render_farm> farm;    // Set while rendering with worker processes
+
+
+    // Renders samples_per_pixel samples in every pixel.
+    void render_fixed(const hittable& world, framebuffer& image) const {
+        render_samples(world, 0, samples_per_pixel, pixel_samples_scale, image);
+    }
+
+
+    // Renders samples [sample0, sample1) of every pixel, storing scale times the sum of each pixel's samples in image.
+    void render_samples(const hittable& world, int sample0, int sample1, double scale, framebuffer& image) const {
+
+        if (farm) {
+            farm->run(tile_scheduler::split_image(image_width, image_height, tile_size), sample0, sample1, scale, image,
+                [&](const tile& t) { render_tile_samples(t, world, sample0, sample1, scale, image); });
+            return;
+        }
+
+        tile_scheduler scheduler(image_width, image_height, tile_size, worker_count());
+
+        std::atomic<int> tiles_remaining(scheduler.num_tiles());
+        std::mutex progress_lock;
+
+        scheduler.run([&](int, const tile& t) {
+
+            render_stats::tile_scope stats(t.x0, t.y0, t.x1, t.y1);
+            render_tile_samples(t, world, sample0, sample1, scale, image);
+
+            int remaining = --tiles_remaining;
+            std::lock_guard<std::mutex> guard(progress_lock);
+            std::clog << "\rTiles remaining: " << remaining << ' ' << std::flush;
+        });
+    }
+
+
+    // Renders in passes of progressive_pass_spp samples per pixel, which are added to an accumulation_buffer. After each
+    // pass the image so far is written to progressive_image_file and the buffer is saved to checkpoint_file (if set).
+    // If checkpoint_file already holds a checkpoint of an image of this size, of the same scene and with the same
+    // settings (see render_key()), the render carries on from it: stopping and resuming gives the same image as
+    // rendering without stopping, and raising samples_per_pixel before resuming adds samples to a finished render.
+    // Any other checkpoint is not resumed; the render starts again and replaces it.
+    void render_progressive(const hittable& world, framebuffer& image) const {
+
+        accumulation_buffer accumulated(image_width, image_height, render_key(world));
+        std::string checkpoint_error;
+        if (!checkpoint_file.empty()) {
+            if (accumulated.load(checkpoint_file, checkpoint_error))
+                std::clog << "Resuming from " << checkpoint_file << " at " << accumulated.samples_done() << " samples per pixel\n";
+            else if (!checkpoint_error.empty())
+                std::cerr << "Not resuming from " << checkpoint_file << ": " << checkpoint_error << '\n';
+        }
+
+        framebuffer pass_sums(image_width, image_height);
+
+        while (accumulated.samples_done() < samples_per_pixel) {
+
+            int sample0 = accumulated.samples_done();
+            int sample1 = std::min(samples_per_pixel, sample0 + std::max(1, progressive_pass_spp));
+
+            std::clog << "\rSamples " << sample0 << "-" << sample1 << " of " << samples_per_pixel << ". ";
+            render_samples(world, sample0, sample1, 1.0, pass_sums);
+            accumulated.add_pass(pass_sums, sample1 - sample0);
+
+            if (!progressive_image_file.empty()) {
+                accumulated.resolve(image);
+                image_writer::write(progressive_image_file, image, output_format);
+            }
+
+            if (!checkpoint_file.empty() && !accumulated.save(checkpoint_file))
+                std::cerr << "\nCould not write checkpoint " << checkpoint_file << '\n';
+        }
+
+        accumulated.resolve(image);
+    }
+
+
+    // Renders in passes. Every pixel gets adaptive_min_spp samples in the first pass (but no more than
+    // samples_per_pixel, so that the first pass fits in the budget). After each pass, the pixels that have not converged
+    // (see pixel_estimate) get as many samples again as they already have, up to adaptive_max_spp, scaled down if need
+    // be to fit what is left of the samples_per_pixel * pixels budget. Rendering stops when the budget is spent or every
+    // pixel has converged. The image is the mean of each pixel's samples.
+    void render_adaptive(const hittable& world, framebuffer& image) const {
+
+        const size_t pixels = image.size();
+        const long long budget = (long long)samples_per_pixel * (long long)pixels;
+        long long used = 0;
+
+        std::vector<pixel_estimate> estimates(pixels);
+        int first_pass = std::min(adaptive_min_spp, std::min(adaptive_max_spp, samples_per_pixel));
+        std::vector<int> pass_samples(pixels, std::max(1, first_pass));
+
+        for (int pass = 1; ; pass++) {
+
+            long long pass_total = 0;
+            size_t active = 0;
+            for (auto n : pass_samples) {
+                pass_total += n;
+                active += (n > 0);
+            }
+            if (pass_total == 0)
+                break;
+
+            std::clog << "\rPass " << pass << ": " << active << " pixels, " << pass_total << " samples          " << std::flush;
+
+            tile_scheduler scheduler(image_width, image_height, tile_size, worker_count());
+            scheduler.run([&](int, const tile& t) {
+                render_stats::tile_scope stats(t.x0, t.y0, t.x1, t.y1);
+                sample_tile(t, world, estimates, pass_samples);
+            });
+            used += pass_total;
+
+            // Plan the next pass.
+            long long wanted = 0;
+            for (size_t p = 0; p < pixels; p++) {
+                const pixel_estimate& e = estimates[p];
+                pass_samples[p] = e.converged(adaptive_threshold) ? 0 : std::max(0, std::min(e.count, adaptive_max_spp - e.count));
+                wanted += pass_samples[p];
+            }
+
+            long long remaining = std::max(0LL, budget - used);
+            if (wanted > remaining) {
+                for (auto& n : pass_samples)
+                    n = int(n * remaining / wanted);
+            }
+        }
+
+        for (size_t p = 0; p < pixels; p++)
+            image[p] = estimates[p].mean;
+
+        if (!sample_count_file.empty())
+            write_sample_counts(estimates);
+    }
+
+
+    // Adds pass_samples[pixel] more samples to the estimate of each pixel of one tile.
+    void sample_tile(const tile& t, const hittable& world, std::vector<pixel_estimate>& estimates, const std::vector<int>& pass_samples) const {
+
+        if (integrator == integrator_type::wavefront) {
+            sample_tile_wavefront(t, world, estimates, pass_samples);
+            return;
+        }
+
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                size_t p = size_t(j) * image_width + i;
+                uint64_t cost_mark = render_stats::mark();
+                int first = estimates[p].count;
+                for (int sample = first; sample < first + pass_samples[p]; sample++) {
+                    sampler::begin_sample(p, uint32_t(sample));
+                    estimates[p].add(ray_color(get_ray(i, j), world));
+                }
+                render_stats::add_pixel_cost(p, cost_mark);
+                render_stats::add_pixel_samples(p, pass_samples[p]);
+            }
+        }
+    }
+
+
+    // As sample_tile(), tracing up to wavefront_paths samples at a time with a wavefront_integrator. The samples are
+    // added to the estimates in the same order as sample_tile() adds them, so the image is the same up to the rounding
+    // of the wavefront integrator (see wavefront.h).
+    void sample_tile_wavefront(const tile& t, const hittable& world, std::vector<pixel_estimate>& estimates, const std::vector<int>& pass_samples) const {
+
+        // The (pixel, sample) pairs to trace, in pixel order.
+        std::vector<std::pair<size_t, int>> samples;
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                size_t p = size_t(j) * image_width + i;
+                for (int sample = estimates[p].count; sample < estimates[p].count + pass_samples[p]; sample++)
+                    samples.push_back(std::make_pair(p, sample));
+                render_stats::add_pixel_samples(p, pass_samples[p]);
+            }
+        }
+
+        const size_t batch_size = size_t(std::max(1, wavefront_paths));
+        std::vector<color> radiance;
+        wavefront_integrator wavefront(world, max_depth, roulette_policy(), background);
+
+        for (size_t first = 0; first < samples.size(); first += batch_size) {
+            size_t last = std::min(samples.size(), first + batch_size);
+
+            for (size_t k = first; k < last; k++) {
+                size_t p = samples[k].first;
+                int i = int(p % image_width), j = int(p / image_width);
+                sampler::begin_sample(p, uint32_t(samples[k].second));
+                wavefront.add_path(get_ray(i, j), p, uint32_t(samples[k].second), uint32_t(k - first));
+            }
+
+            radiance.assign(last - first, color(0,0,0));
+            wavefront.trace(radiance.data());
+
+            for (size_t k = first; k < last; k++)
+                estimates[samples[k].first].add(radiance[k - first]);
+        }
+    }
+
+
+    // Writes the number of samples taken in each pixel as a plain PGM image (brighter is more samples).
+    void write_sample_counts(const std::vector<pixel_estimate>& estimates) const {
+
+        int max_count = 1;
+        for (const auto& e : estimates)
+            max_count = std::max(max_count, e.count);
+
+        std::ofstream out(sample_count_file);
+        out << "P2\n" << image_width << ' ' << image_height << '\n' << std::min(max_count, 65535) << '\n';
+        for (const auto& e : estimates)
+            out << std::min(e.count, 65535) << '\n';
+    }
+
+
+    // Writes the mean traversal cost of a sample in each pixel (BVH nodes visited plus primitives tested, see
+    // render_stats.h) as a heatmap in output_format: blue for the cheapest pixels, through green, to red for the most
+    // expensive.
+    void write_stats_heatmap() const {
+
+        std::vector<double> costs = render_stats::cost_per_sample();
+        double max_cost = 0;
+        for (auto c : costs)
+            max_cost = std::max(max_cost, c);
+
+        framebuffer heatmap(image_width, image_height);
+        for (size_t p = 0; p < heatmap.size(); p++) {
+            double x = max_cost > 0 ? costs[p] / max_cost : 0;
+            heatmap[p] = x < 0.5 ? (1 - 2*x) * color(0,0,1) + 2*x * color(0,1,0)
+                                 : (2 - 2*x) * color(0,1,0) + (2*x - 1) * color(1,0,0);
+        }
+
+        if (image_writer::write(stats_heatmap_file, heatmap, output_format))
+            std::clog << "Heatmap written to " << stats_heatmap_file << " (red = " << max_cost << " per sample)\n";
+        else
+            std::cerr << "Could not write heatmap " << stats_heatmap_file << '\n';
+    }
+
+
+    // Renders samples [sample0, sample1) of each pixel of one tile with the chosen integrator, and stores scale times the
+    // sum of each pixel's samples in image.
+    void render_tile_samples(const tile& t, const hittable& world, int sample0, int sample1, double scale, framebuffer& image) const {
+        if (integrator == integrator_type::wavefront)
+            render_tile_wavefront(t, world, sample0, sample1, scale, image);
+        else if (packet_tracing && max_depth > 0)
+            render_tile_packets(t, world, sample0, sample1, scale, image);
+        else
+            render_tile(t, world, sample0, sample1, scale, image);
+    }
+
+
+    // Starts the worker processes (farm_workers) and opens farm_port for remote workers. If neither works out, the
+    // image is rendered in this process.
+    void start_farm(const hittable& world) {
+
+        if (!render_farm::supported) {
+            std::cerr << "Distributed rendering is not supported on this system; rendering in this process\n";
+            return;
+        }
+
+        farm = std::make_shared<render_farm>(render_key(world));
+        farm->tile_timeout = farm_tile_timeout;
+
+        if (farm_workers > 0) {
+            farm->start_local_workers(farm_workers, [&](int fd) {
+                render_farm::serve(fd, render_key(world), 1, image_width, image_height,
+                    [&](const tile& t, int sample0, int sample1, double scale, framebuffer& image) {
+                        render_tile_samples(t, world, sample0, sample1, scale, image);
+                    });
+            });
+        }
+
+        bool listening = farm_port > 0 && farm->listen_on(farm_port);
+        if (farm_port > 0 && !listening)
+            std::cerr << "Could not listen on port " << farm_port << '\n';
+
+        if (farm->live_workers() == 0 && !listening) {
+            std::cerr << "No render workers could be started; rendering in this process\n";
+            farm.reset();
+            return;
+        }
+        std::clog << "Rendering with " << farm->live_workers() << " worker process(es)"
+                  << (listening ? " and any that join on port " + std::to_string(farm_port) : std::string()) << '\n';
+    }
+
+
+    // Hash of everything that decides the colour of a pixel sample: the camera settings and the scene (scene_key, and
+    // the world's bounds in case scene_key was not set). Workers only render for a coordinator with the same key, and
+    // a checkpoint is only resumed by a render with the same key.
+    uint64_t render_key(const hittable& world) const {
+
+        uint64_t h = hash_seed;
+        hash_combine(h, sizeof(real));
+        hash_combine(h, uint64_t(image_width));
+        hash_combine(h, uint64_t(image_height));
+        hash_combine(h, uint64_t(max_depth));
+        hash_double(h, vfov);
+        for (int axis = 0; axis < 3; axis++) {
+            hash_double(h, lookfrom[axis]);
+            hash_double(h, lookat[axis]);
+            hash_double(h, vup[axis]);
+        }
+        hash_double(h, defocus_angle);
+        hash_double(h, focus_dist);
+        hash_double(h, shutter_open);
+        hash_double(h, shutter_close);
+        hash_combine(h, uint64_t(integrator));
+        hash_combine(h, uint64_t(roulette_depth));
+        hash_double(h, roulette_min_survival);
+        hash_combine(h, scene_key);
+
+        aabb bounds = world.bounding_box();
+        for (int axis = 0; axis < 3; axis++) {
+            hash_double(h, bounds.axis_interval(axis).min);
+            hash_double(h, bounds.axis_interval(axis).max);
+        }
+        return h;
+    }
+
+
+    // Renders samples [sample0, sample1) of each pixel of one tile, one ray at a time, and stores scale times the sum of
+    // each pixel's samples in image.
+    void render_tile(const tile& t, const hittable& world, int sample0, int sample1, double scale, framebuffer& image) const {
+
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+
+                // Will be used to hold the average colour of samples_per_pixel sampled rays
+                color pixel_color(0,0,0);
+                uint64_t cost_mark = render_stats::mark();
+
+                for (int sample = sample0; sample < sample1; sample++) {
+
+                  sampler::begin_sample(uint64_t(j) * image_width + i, uint32_t(sample));
+
+                  // Get a ray that points at through a random point in the current pixel's space.
+                  ray r = get_ray(i, j);
+
+                  // Get the colour of the current ray and add it to the colour sum (will be averaged later)
+                  pixel_color += ray_color(r, world);
+                }
+
+                image[size_t(j) * image_width + i] = scale * pixel_color;
+                render_stats::add_pixel_cost(size_t(j) * image_width + i, cost_mark);
+                render_stats::add_pixel_samples(size_t(j) * image_width + i, sample1 - sample0);
+            }
+        }
+    }
+
+
+    // Renders the pixels of one tile into image, tracing the camera rays of ray_packet::size neighbouring pixels in a
+    // row as one packet. The packet only exists until the first hit: the rays scatter in unrelated directions, so each
+    // bounce after that is traced on its own. Produces the same image as render_tile().
+    void render_tile_packets(const tile& t, const hittable& world, int sample0, int sample1, double scale, framebuffer& image) const {
+
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i0 = t.x0; i0 < t.x1; i0 += ray_packet::size) {
+
+                int lanes = std::min(int(ray_packet::size), t.x1 - i0);
+                unsigned int active = (1u << lanes) - 1;
+
+                color pixel_colors[ray_packet::size];
+                uint64_t cost_mark = render_stats::mark();
+
+                for (int sample = sample0; sample < sample1; sample++) {
+
+                    ray rays[ray_packet::size];
+                    ray_packet packet(ray_t_min);
+                    for (int lane = 0; lane < lanes; lane++) {
+                        sampler::begin_sample(uint64_t(j) * image_width + i0 + lane, uint32_t(sample));
+                        rays[lane] = get_ray(i0 + lane, j);
+                        packet.set(lane, rays[lane], infinity);
+                    }
+
+                    hit_record recs[ray_packet::size];
+                    unsigned int hits = world.hit_packet(packet, active, recs);
+                    RTW_STAT(rays, lanes);
+
+                    for (int lane = 0; lane < lanes; lane++) {
+                        sampler::begin_sample(uint64_t(j) * image_width + i0 + lane, uint32_t(sample));
+                        pixel_colors[lane] += shade(rays[lane], hits >> lane & 1u, recs[lane], world);
+                    }
+                }
+
+                // The work of the packet's pixels is shared evenly between them in the heatmap.
+                for (int lane = 0; lane < lanes; lane++) {
+                    image[size_t(j) * image_width + i0 + lane] = scale * pixel_colors[lane];
+                    render_stats::add_pixel_cost(size_t(j) * image_width + i0 + lane, cost_mark, lanes);
+                    render_stats::add_pixel_samples(size_t(j) * image_width + i0 + lane, sample1 - sample0);
+                }
+            }
+        }
+    }
+
+
+    // Renders the pixels of one tile into image with a wavefront_integrator. As many whole samples of the tile as fit
+    // in about wavefront_paths paths are traced together, so that each stage of the integrator works on a large batch.
+    void render_tile_wavefront(const tile& t, const hittable& world, int sample0, int sample1, double scale, framebuffer& image) const {
+
+        const int width = t.x1 - t.x0;
+        const int pixels = width * (t.y1 - t.y0);
+        const int samples_per_batch = std::max(1, wavefront_paths / pixels);
+
+        std::vector<color> pixel_colors(pixels);
+        wavefront_integrator wavefront(world, max_depth, roulette_policy(), background);
+
+        for (int batch0 = sample0; batch0 < sample1; batch0 += samples_per_batch) {
+            int batch1 = std::min(sample1, batch0 + samples_per_batch);
+
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    uint32_t slot = uint32_t((j - t.y0) * width + (i - t.x0));
+                    for (int sample = batch0; sample < batch1; sample++) {
+                        uint64_t pixel = uint64_t(j) * image_width + i;
+                        sampler::begin_sample(pixel, uint32_t(sample));
+                        wavefront.add_path(get_ray(i, j), pixel, uint32_t(sample), slot);
+                    }
+                }
+            }
+
+            wavefront.trace(pixel_colors.data());
+        }
+
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                image[size_t(j) * image_width + i] = scale * pixel_colors[(j - t.y0) * width + (i - t.x0)];
+                render_stats::add_pixel_samples(size_t(j) * image_width + i, sample1 - sample0);
+            }
+        }
+    }
+
+
+    // Resolves num_threads = 0 to the number of hardware threads.
+    int worker_count() const {
+        if (num_threads > 0)
+            return num_threads;
+        unsigned int hardware_threads = std::thread::hardware_concurrency();
+        return hardware_threads > 0 ? int(hardware_threads) : 1;
+    }
+
 
     void initialize() {
         image_height = int(image_width / aspect_ratio);
@@ -132,7 +672,7 @@ class camera {
 
       auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
       auto ray_direction = pixel_sample - ray_origin;
-      auto ray_time = random_double();                                            // Time at which ray was fired, t = [0,1], for motion blur effect.
+      auto ray_time = shutter_open + (shutter_close - shutter_open) * random_double();    // Time at which ray was fired, within the shutter interval, for motion blur effect.
 
       return ray(ray_origin, ray_direction, ray_time);
     }
@@ -151,29 +691,81 @@ class camera {
     }
 
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
+    color ray_color(const ray& r, const hittable& world) const {
         
-      // If we've exceeded the ray bounce limit, no more light is gathered.
-      if (depth <= 0)
+      // If the bounce limit allows no rays at all, no light is gathered.
+      if (max_depth <= 0)
         return color(0,0,0);
 
       hit_record rec;
 
-        // world is a list of hittables. world.hit() returns the closest intersection (or false if none)
-        // The t_min = 0.001 is a hack to stop shadow acne effect: round off errors putting origin of next ray below surface (section 9.3).
-        if (world.hit(r, interval(0.001, infinity), rec)) {
+      // world is a list of hittables. world.hit() returns the closest intersection (or false if none)
+      // The t_min = ray_t_min (0.001 in double precision) is a hack to stop shadow acne effect: round off errors putting origin of next ray below surface (section 9.3).
+      bool hit = world.hit(r, interval(ray_t_min, infinity), rec);
+      RTW_STAT(rays, 1);
+
+      return shade(r, hit, rec, world);
+    }
+
+
+    // Colour of camera ray r, given the result of intersecting it with the world (rec is only valid if hit is true).
+    // Follows the path bounce by bounce, keeping the product of the attenuations so far in throughput (rather than
+    // multiplying them together on the way back out of a recursive call per bounce). With Russian roulette turned off
+    // this is the same estimator as the recursive form, but the attenuations are multiplied in the opposite order, so
+    // the two images agree only up to floating point rounding.
+    color shade(ray r, bool hit, hit_record rec, const hittable& world) const {
+
+        color throughput(1,1,1);
+        russian_roulette roulette = roulette_policy();
+
+        int bounces = 0;
+        for (; hit; bounces++) {
+
+          // If we've reached the ray bounce limit, no more light is gathered.
+          if (bounces + 1 >= max_depth) {
+            RTW_STAT_PATH(bounces + 1);
+            return color(0,0,0);
+          }
 
           ray scattered;
           color attenuation;
 
+          // Random numbers for this scattering event come from their own (pixel, sample, bounce) sequence.
+          sampler::begin_bounce(uint32_t(bounces + 1));
+
           // rec.mat->scatter() is the scattering function of the material the hittable object is made of.
           // It gives us the attenuation factor of the material and a scattered ray object in "attenuation" and "scattered".
-          if (rec.mat->scatter(r, rec, attenuation, scattered))         
-            return attenuation * ray_color(scattered, depth-1, world);
-
-          return color(0,0,0);  // Case where light was not scattered (absorbed).
+          if (!rec.mat->scatter(r, rec, attenuation, scattered)) {
+            RTW_STAT_PATH(bounces + 1);
+            return color(0,0,0);  // Case where light was not scattered (absorbed).
+          }
+
+          throughput = throughput * attenuation;
+          if (!roulette.survives(bounces + 1, throughput)) {
+            RTW_STAT_PATH(bounces + 1);
+            return color(0,0,0);
+          }
+
+          r = scattered;
+          hit = world.hit(r, interval(ray_t_min, infinity), rec);
+          RTW_STAT(rays, 1);
         }
 
+        RTW_STAT_PATH(bounces + 1);
+        return throughput * background(r);
+    }
+
+
+    russian_roulette roulette_policy() const {
+        russian_roulette roulette;
+        roulette.start_depth = roulette_depth;
+        roulette.min_survival = roulette_min_survival;
+        return roulette;
+    }
+
+
+    // Colour of a ray that escapes the scene.
+    static color background(const ray& r) {
         // Create gradient background (sky)
         vec3 unit_direction = unit_vector(r.direction());
         auto a = 0.5*(unit_direction.y() + 1.0);                        // scale a to: 0 <= a <= 1
@@ -16,22 +16,20 @@ inline double linear_to_gamma(double linear_component)
 }
 
 
-void write_color(std::ostream& out, const color& pixel_color) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    // Apply a linear to gamma transform for gamma 2
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
+// Converts a linear colour to 8-bit gamma 2 components (as written to image files).
+inline void color_to_bytes(const color& pixel_color, unsigned char bytes[3]) {
     // Translate the [0,1] component values to the byte range [0,255].
     static const interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    for (int c = 0; c < 3; c++)
+        bytes[c] = (unsigned char)(int(256 * intensity.clamp(linear_to_gamma(pixel_color[c]))));
+}
+
+
+void write_color(std::ostream& out, const color& pixel_color) {
+    // Apply a linear to gamma transform for gamma 2, and convert to bytes.
+    unsigned char bytes[3];
+    color_to_bytes(pixel_color, bytes);
 
     // Write out the pixel color components.
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
-}
\ No newline at end of file
+    out << int(bytes[0]) << ' ' << int(bytes[1]) << ' ' << int(bytes[2]) << '\n';
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+
+// A small zlib (RFC 1950) compressor, enough for writing PNG files without an external library. The data is
+// compressed as a single deflate (RFC 1951) block with the fixed Huffman codes: matches are found with a hash of the
+// next 3 bytes and a chain of earlier positions with the same hash, searching a limited number of candidates.
+// Without dynamic Huffman codes the output is somewhat larger than zlib's (about a fifth, for rendered images), for
+// a fraction of the code.
+class zlib_compressor {
+
+  public:
+
+    // Returns data[0, size) compressed as a zlib stream.
+    static std::vector<unsigned char> compress(const unsigned char* data, size_t size) {
+        zlib_compressor z;
+        z.out.reserve(size / 2 + 64);
+
+        // zlib header: deflate with a 32K window (0x78), no dictionary, fastest compression level (0x01).
+        z.out.push_back(0x78);
+        z.out.push_back(0x01);
+
+        z.deflate(data, size);
+
+        uint32_t adler = adler32(data, size);
+        for (int shift = 24; shift >= 0; shift -= 8)
+            z.out.push_back((unsigned char)(adler >> shift));
+
+        return std::move(z.out);
+    }
+
+    static uint32_t adler32(const unsigned char* data, size_t size) {
+        uint32_t a = 1, b = 0;
+        while (size > 0) {
+            size_t n = size < 5552 ? size : 5552;       // Largest run that cannot overflow b before the modulo
+            size -= n;
+            while (n-- > 0) {
+                a += *data++;
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        return (b << 16) | a;
+    }
+
+
+  private:
+
+    static const int window_size = 32768;
+    static const int min_match = 3;
+    static const int max_match = 258;
+    static const int hash_bits = 15;
+    static const int max_chain = 32;                // Candidate matches examined per position
+
+    std::vector<unsigned char> out;
+    uint32_t bit_buffer = 0;                        // Bits not yet written out (least significant bit first)
+    int bit_count = 0;
+
+
+    void deflate(const unsigned char* data, size_t size) {
+
+        write_bits(1, 1);                           // BFINAL: this is the last block
+        write_bits(1, 2);                           // BTYPE = 01: fixed Huffman codes
+
+        // head[h] is the latest position whose next 3 bytes hash to h; prev[pos % window_size] the one before it.
+        std::vector<int64_t> head(size_t(1) << hash_bits, -1);
+        std::vector<int64_t> prev(window_size, -1);
+
+        size_t pos = 0;
+        while (pos < size) {
+
+            int best_length = 0;
+            size_t best_distance = 0;
+
+            if (pos + min_match <= size) {
+                uint32_t h = hash(data + pos);
+                int64_t candidate = head[h];
+                size_t limit = size - pos < size_t(max_match) ? size - pos : size_t(max_match);
+
+                for (int chain = 0; chain < max_chain && candidate >= 0 && pos - size_t(candidate) <= size_t(window_size); chain++) {
+                    const unsigned char* a = data + candidate;
+                    const unsigned char* b = data + pos;
+                    int length = 0;
+                    while (size_t(length) < limit && a[length] == b[length])
+                        length++;
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = pos - size_t(candidate);
+                        if (size_t(length) == limit)
+                            break;
+                    }
+                    candidate = prev[size_t(candidate) % window_size];
+                }
+            }
+
+            int advance = 1;
+            if (best_length >= min_match) {
+                write_match(best_length, int(best_distance));
+                advance = best_length;
+            } else {
+                write_literal(data[pos]);
+            }
+
+            // Enter every position passed over into the hash chains.
+            for (int k = 0; k < advance; k++, pos++) {
+                if (pos + min_match <= size) {
+                    uint32_t h = hash(data + pos);
+                    prev[pos % window_size] = head[h];
+                    head[h] = int64_t(pos);
+                }
+            }
+        }
+
+        write_symbol(256);                          // End of block
+        if (bit_count > 0)
+            out.push_back((unsigned char)bit_buffer);
+    }
+
+
+    static uint32_t hash(const unsigned char* p) {
+        uint32_t v = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16;
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // Appends the count lowest bits of value, least significant first (how deflate packs everything but Huffman codes).
+    void write_bits(uint32_t value, int count) {
+        bit_buffer |= value << bit_count;
+        bit_count += count;
+        while (bit_count >= 8) {
+            out.push_back((unsigned char)bit_buffer);
+            bit_buffer >>= 8;
+            bit_count -= 8;
+        }
+    }
+
+    // Appends a Huffman code of length bits, most significant bit first.
+    void write_code(uint32_t code, int length) {
+        uint32_t reversed = 0;
+        for (int k = 0; k < length; k++)
+            reversed |= ((code >> k) & 1u) << (length - 1 - k);
+        write_bits(reversed, length);
+    }
+
+    // Appends a literal/length symbol (0-287) with its fixed Huffman code.
+    void write_symbol(int symbol) {
+        if (symbol < 144)
+            write_code(0x30 + symbol, 8);
+        else if (symbol < 256)
+            write_code(0x190 + symbol - 144, 9);
+        else if (symbol < 280)
+            write_code(symbol - 256, 7);
+        else
+            write_code(0xc0 + symbol - 280, 8);
+    }
+
+    void write_literal(unsigned char byte) { write_symbol(byte); }
+
+    void write_match(int length, int distance) {
+
+        static const int length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                             35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                              3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const int distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                               257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+                                               12289, 16385, 24577 };
+        static const int distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                                7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+        int l = 28;
+        while (length_base[l] > length)
+            l--;
+        write_symbol(257 + l);
+        write_bits(uint32_t(length - length_base[l]), length_extra[l]);
+
+        int d = 29;
+        while (distance_base[d] > distance)
+            d--;
+        write_code(uint32_t(d), 5);
+        write_bits(uint32_t(distance - distance_base[d]), distance_extra[d]);
+    }
+};
@@ -0,0 +1,514 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// A bounding volume hierarchy that can be changed after it is built, for scenes that are edited interactively. Objects
+// can be inserted and removed, and the boxes refitted after objects move, without building the tree again.
+//
+// The tree is kept as a pool of nodes linked by index (with links to their parents), with one object in each leaf.
+// A new object is placed next to the node where it adds the least surface area to the tree, found by descending from
+// the root, and removing an object puts its sibling in place of their parent; either way, only the boxes on the path
+// to the root change. Refitting keeps the structure of the tree, though, so after many edits the tree is worse than a
+// fresh build would be. The tree therefore keeps its surface area heuristic cost up to date (see bvh_sah_cost()), and
+// is built again from scratch, with bvh_builder, once that has grown past rebuild_threshold times the cost of the last
+// full build. The costs are compared per unit of leaf area (see relative_cost()): inserting objects adds to the cost of
+// any tree, however well built, and removing them takes from it, so the cost alone would call for rebuilds after
+// inserts that did no harm and hide the harm done by removals. Even so, what a fresh build would cost depends on how
+// densely the objects fill the tree's bounds, so the tree is also built again once the number of objects has doubled
+// or halved since the last build (which costs no more, spread over the inserts, than building the tree twice).
+class dynamic_bvh : public hittable {
+
+  public:
+
+    double rebuild_threshold = 1.3;     // Rebuild once the cost grows past this multiple of the last build's (0 = never rebuild by itself)
+    double traversal_cost    = 1.0;     // Cost of visiting a node relative to intersecting an object (for the cost and the rebuilds)
+    int    num_threads       = 0;       // Threads used to refit and rebuild large trees (0 = all hardware threads)
+
+
+    dynamic_bvh() {}
+
+    explicit dynamic_bvh(const hittable_list& list) {
+        for (const auto& object : list.objects)
+            add_object(object);
+        rebuild();
+    }
+
+
+    // Adds object to the tree, and returns its id (for update() and remove()).
+    uint32_t insert(shared_ptr<hittable> object) {
+        uint32_t id = add_object(object);
+        insert_leaf(leaf_of[id]);
+        rebuild_if_degraded();
+        return id;
+    }
+
+    // Removes the object with the given id from the tree. Its id may be given to an object inserted later.
+    void remove(uint32_t id) {
+        int leaf = leaf_of[id];
+        remove_leaf(leaf);
+        free_node(leaf);
+        objects[id].reset();
+        free_ids.push_back(id);
+        object_count--;
+        rebuild_if_degraded();
+    }
+
+    // Takes account of the object with the given id having moved or changed size. If its new box lies within its old
+    // one, the boxes on its path to the root are refitted; otherwise it is reinserted where it now fits best.
+    void update(uint32_t id) {
+        int leaf = leaf_of[id];
+        aabb box = objects[id]->bounding_box();
+
+        if (contains(nodes[leaf].box, box)) {
+            area_sum -= contribution(leaf);
+            leaf_area_sum -= nodes[leaf].box.surface_area();
+            nodes[leaf].box = box;
+            area_sum += contribution(leaf);
+            leaf_area_sum += box.surface_area();
+            refit_path(nodes[leaf].parent);
+        } else {
+            remove_leaf(leaf);
+            nodes[leaf].box = box;
+            insert_leaf(leaf);
+        }
+        rebuild_if_degraded();
+    }
+
+    // Recomputes every box in the tree, after many objects have moved. Large trees are refitted with num_threads
+    // threads: the subtrees below the top few levels at the same time, and then the nodes above them.
+    void refit() {
+
+        if (root < 0)
+            return;
+
+        int threads = thread_count();
+        const size_t min_parallel_objects = 16384;      // Smallest tree worth refitting with several threads
+        if (threads == 1 || object_count < min_parallel_objects) {
+            area_sum = leaf_area_sum = 0;
+            refit_subtree(root, area_sum, leaf_area_sum);
+            rebuild_if_degraded();
+            return;
+        }
+
+        // Split the top of the tree into about four subtrees per thread. The nodes above them are kept in top, in the
+        // order they were split (parents before children).
+        std::vector<int> top;
+        std::vector<int> subtrees(1, root);
+        while (subtrees.size() < size_t(4 * threads)) {
+            std::vector<int> next;
+            for (int n : subtrees) {
+                if (nodes[n].is_leaf()) {
+                    next.push_back(n);
+                    continue;
+                }
+                top.push_back(n);
+                next.push_back(nodes[n].child[0]);
+                next.push_back(nodes[n].child[1]);
+            }
+            if (next.size() == subtrees.size())
+                break;
+            subtrees.swap(next);
+        }
+
+        std::vector<std::future<std::pair<double, double>>> tasks;
+        for (int t = 0; t < threads; t++) {
+            tasks.push_back(std::async(std::launch::async, [this, t, threads, &subtrees]() {
+                std::pair<double, double> sums(0, 0);
+                for (size_t s = size_t(t); s < subtrees.size(); s += size_t(threads))
+                    refit_subtree(subtrees[s], sums.first, sums.second);
+                return sums;
+            }));
+        }
+
+        area_sum = leaf_area_sum = 0;
+        for (auto& task : tasks) {
+            std::pair<double, double> sums = task.get();
+            area_sum += sums.first;
+            leaf_area_sum += sums.second;
+        }
+
+        for (auto n = top.rbegin(); n != top.rend(); ++n) {
+            nodes[*n].box = aabb(nodes[nodes[*n].child[0]].box, nodes[nodes[*n].child[1]].box);
+            area_sum += contribution(*n);
+        }
+        rebuild_if_degraded();
+    }
+
+    // Builds the tree again from scratch, over the objects it holds now. Their ids stay the same.
+    void rebuild() {
+
+        nodes.clear();
+        free_nodes.clear();
+        root = -1;
+        area_sum = leaf_area_sum = 0;
+
+        std::vector<uint32_t> ids;
+        std::vector<aabb> boxes;
+        for (uint32_t id = 0; id < objects.size(); id++) {
+            if (objects[id]) {
+                ids.push_back(id);
+                boxes.push_back(objects[id]->bounding_box());
+            }
+        }
+
+        if (!ids.empty()) {
+            bvh_build_options options;
+            options.split          = bvh_split_method::sah;
+            options.max_leaf_size  = 1;
+            options.traversal_cost = traversal_cost;
+            options.num_threads    = num_threads;
+
+            bvh_builder builder(boxes, options);
+            nodes.reserve(2 * ids.size());
+            root = convert(builder, 0, -1, ids, boxes);
+        }
+
+        built_cost = relative_cost();
+        built_count = object_count;
+    }
+
+
+    size_t size() const { return object_count; }
+
+    // Expected cost of a ray through the tree, relative to one object intersection (as bvh_sah_cost()).
+    double sah_cost() const {
+        double root_area = root < 0 ? 0 : nodes[root].box.surface_area();
+        return root_area > 0 ? area_sum / root_area : 0;
+    }
+
+    // sah_cost() per unit of the leaves' surface area: 1 plus the cost of the interior nodes per unit of leaf area.
+    // Every object adds its leaf to sah_cost(), however well it is placed; this counts only what the tree's structure
+    // adds on top, so it changes far less than sah_cost() as objects are inserted and removed.
+    double relative_cost() const { return leaf_area_sum > 0 ? area_sum / leaf_area_sum : 0; }
+
+    // The relative_cost() of the tree now relative to that when it was last built from scratch (1 just after a
+    // rebuild, or while the tree has at most one object).
+    double quality() const { return built_cost > 0 ? relative_cost() / built_cost : 1; }
+
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+
+        if (root < 0)
+            return false;
+
+        // The tree is not kept balanced, so the stack of nodes still to visit can grow past any fixed size: it spills
+        // from a small array into a vector. Both are local, as an object's own hit() may be that of another
+        // dynamic_bvh (on the same thread).
+        const int fixed_size = 64;
+        int fixed_stack[fixed_size];
+        std::vector<int> spilled;
+        int stack_size = 0;
+
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+        const vec3& dir = r.direction();
+        int current = root;
+
+        while (true) {
+            const node& n = nodes[current];
+            RTW_STAT(node_visits, 1);
+
+            if (n.box.hit(r, interval(ray_t.min, closest_so_far))) {
+
+                if (n.is_leaf()) {
+                    RTW_STAT(primitive_tests, 1);
+                    if (objects[n.object]->hit(r, interval(ray_t.min, closest_so_far), rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                } else {
+                    // Visit the child whose centre is nearer along the ray first, so that the other can more often be
+                    // skipped.
+                    int first = n.child[0], second = n.child[1];
+                    double along = 0;
+                    for (int axis = 0; axis < 3; axis++) {
+                        const interval& a = nodes[first].box.axis_interval(axis);
+                        const interval& b = nodes[second].box.axis_interval(axis);
+                        along += (b.min + b.max - a.min - a.max) * dir[axis];
+                    }
+                    if (along < 0)
+                        std::swap(first, second);
+
+                    if (stack_size < fixed_size)
+                        fixed_stack[stack_size] = second;
+                    else
+                        spilled.push_back(second);
+                    stack_size++;
+                    current = first;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            stack_size--;
+            if (stack_size < fixed_size) {
+                current = fixed_stack[stack_size];
+            } else {
+                current = spilled.back();
+                spilled.pop_back();
+            }
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return root < 0 ? aabb::empty : nodes[root].box; }
+
+
+  private:
+
+    struct node {
+        aabb     box;
+        int      parent;            // -1 for the root
+        int      child[2];          // -1 for a leaf
+        uint32_t object;            // Leaf: id of its object
+
+        bool is_leaf() const { return child[0] < 0; }
+    };
+
+    std::vector<node> nodes;
+    std::vector<int> free_nodes;                    // Nodes no longer in the tree, for reuse
+    int root = -1;
+
+    std::vector<shared_ptr<hittable>> objects;      // By id (null for ids no longer in use)
+    std::vector<int> leaf_of;                       // Leaf node of each object
+    std::vector<uint32_t> free_ids;
+    size_t object_count = 0;
+
+    double area_sum = 0;            // Sum over the nodes of their cost times their surface area (sah_cost() times the root's area)
+    double leaf_area_sum = 0;       // Sum of the leaves' surface areas (their part of area_sum)
+    double built_cost = 0;          // relative_cost() after the last rebuild() (see rebuild_if_degraded())
+    size_t built_count = 0;         // Number of objects at the last rebuild()
+
+
+    // Cost of a node times its surface area: its part of area_sum.
+    double contribution(int n) const {
+        return (nodes[n].is_leaf() ? 1.0 : traversal_cost) * nodes[n].box.surface_area();
+    }
+
+    static bool contains(const aabb& outer, const aabb& inner) {
+        for (int axis = 0; axis < 3; axis++)
+            if (inner.axis_interval(axis).min < outer.axis_interval(axis).min || inner.axis_interval(axis).max > outer.axis_interval(axis).max)
+                return false;
+        return true;
+    }
+
+    int thread_count() const {
+        if (num_threads > 0)
+            return num_threads;
+        unsigned int hardware_threads = std::thread::hardware_concurrency();
+        return hardware_threads > 0 ? int(hardware_threads) : 1;
+    }
+
+    int allocate_node() {
+        if (!free_nodes.empty()) {
+            int n = free_nodes.back();
+            free_nodes.pop_back();
+            return n;
+        }
+        nodes.push_back(node());
+        return int(nodes.size()) - 1;
+    }
+
+    void free_node(int n) { free_nodes.push_back(n); }
+
+    // Stores object under a new id, in a leaf of its own that is not yet in the tree.
+    uint32_t add_object(shared_ptr<hittable> object) {
+        uint32_t id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        } else {
+            id = uint32_t(objects.size());
+            objects.push_back(nullptr);
+            leaf_of.push_back(-1);
+        }
+
+        int leaf = allocate_node();
+        nodes[leaf] = node{object->bounding_box(), -1, {-1, -1}, id};
+        objects[id] = object;
+        leaf_of[id] = leaf;
+        object_count++;
+        return id;
+    }
+
+    // Puts a leaf into the tree, next to the node where it adds the least surface area. Each step down from the root
+    // compares making the leaf a sibling of the node there with going on into either child: the area a new parent
+    // would have, against the growth of the child's box plus the growth all the way down would cost this node.
+    void insert_leaf(int leaf) {
+
+        area_sum += contribution(leaf);
+        leaf_area_sum += nodes[leaf].box.surface_area();
+
+        if (root < 0) {
+            root = leaf;
+            nodes[leaf].parent = -1;
+            return;
+        }
+
+        const aabb box = nodes[leaf].box;
+        int sibling = root;
+        while (!nodes[sibling].is_leaf()) {
+            const node& n = nodes[sibling];
+            double combined = aabb(n.box, box).surface_area();
+            double cost_here = 2 * combined;
+            double inherited = 2 * (combined - n.box.surface_area());
+
+            double cost_child[2];
+            for (int c = 0; c < 2; c++) {
+                const node& child = nodes[n.child[c]];
+                double grown = aabb(child.box, box).surface_area();
+                cost_child[c] = (child.is_leaf() ? grown : grown - child.box.surface_area()) + inherited;
+            }
+
+            if (cost_here < cost_child[0] && cost_here < cost_child[1])
+                break;
+            sibling = cost_child[0] <= cost_child[1] ? n.child[0] : n.child[1];
+        }
+
+        int old_parent = nodes[sibling].parent;
+        int parent = allocate_node();
+        nodes[parent] = node{aabb(nodes[sibling].box, box), old_parent, {sibling, leaf}, 0};
+        area_sum += contribution(parent);
+        nodes[sibling].parent = parent;
+        nodes[leaf].parent = parent;
+
+        if (old_parent < 0) {
+            root = parent;
+        } else {
+            replace_child(old_parent, sibling, parent);
+            refit_path(old_parent);
+        }
+    }
+
+    // Takes a leaf out of the tree (the leaf itself is not freed), putting its sibling in place of their parent.
+    void remove_leaf(int leaf) {
+
+        area_sum -= contribution(leaf);
+        leaf_area_sum -= nodes[leaf].box.surface_area();
+
+        if (leaf == root) {
+            root = -1;
+            return;
+        }
+
+        int parent = nodes[leaf].parent;
+        int grandparent = nodes[parent].parent;
+        int sibling = nodes[parent].child[0] == leaf ? nodes[parent].child[1] : nodes[parent].child[0];
+
+        area_sum -= contribution(parent);
+        free_node(parent);
+
+        nodes[sibling].parent = grandparent;
+        if (grandparent < 0) {
+            root = sibling;
+        } else {
+            replace_child(grandparent, parent, sibling);
+            refit_path(grandparent);
+        }
+    }
+
+    void replace_child(int parent, int old_child, int new_child) {
+        int c = nodes[parent].child[0] == old_child ? 0 : 1;
+        nodes[parent].child[c] = new_child;
+    }
+
+    // Recomputes the boxes of node n and its ancestors from their children's.
+    void refit_path(int n) {
+        for (; n >= 0; n = nodes[n].parent) {
+            area_sum -= contribution(n);
+            nodes[n].box = aabb(nodes[nodes[n].child[0]].box, nodes[nodes[n].child[1]].box);
+            area_sum += contribution(n);
+        }
+    }
+
+    // Recomputes every box in the subtree at n (the leaves' from their objects), and adds the subtree's parts of area_sum
+    // and leaf_area_sum to sum and leaf_sum. The nodes are visited in reverse depth-first order, so that children come
+    // before their parents.
+    void refit_subtree(int n, double& sum, double& leaf_sum) {
+        std::vector<int> order;
+        std::vector<int> stack(1, n);
+        while (!stack.empty()) {
+            int current = stack.back();
+            stack.pop_back();
+            order.push_back(current);
+            if (!nodes[current].is_leaf()) {
+                stack.push_back(nodes[current].child[0]);
+                stack.push_back(nodes[current].child[1]);
+            }
+        }
+
+        for (auto k = order.rbegin(); k != order.rend(); ++k) {
+            node& current = nodes[*k];
+            current.box = current.is_leaf() ? objects[current.object]->bounding_box()
+                                            : aabb(nodes[current.child[0]].box, nodes[current.child[1]].box);
+            sum += contribution(*k);
+            if (current.is_leaf())
+                leaf_sum += current.box.surface_area();
+        }
+    }
+
+    // Copies the subtree at node k of a linear BVH built over the given objects (ids, with their boxes) into the pool,
+    // under parent. Returns the subtree's root.
+    int convert(const bvh_builder& builder, uint32_t k, int parent, const std::vector<uint32_t>& ids, const std::vector<aabb>& boxes) {
+        const linear_bvh_node& linear = builder.nodes[k];
+        if (linear.is_leaf())
+            return convert_leaf(builder, linear.offset, linear.count, parent, ids, boxes);
+
+        int n = allocate_node();
+        int first  = convert(builder, k + 1, n, ids, boxes);
+        int second = convert(builder, linear.offset, n, ids, boxes);
+        nodes[n] = node{aabb(nodes[first].box, nodes[second].box), parent, {first, second}, 0};
+        area_sum += contribution(n);
+        return n;
+    }
+
+    // As convert(), for the objects of a linear BVH leaf (builder.indices[first, first+count)). The builder makes
+    // leaves of one object here, but a leaf of several is split in two until each object has a leaf of its own.
+    int convert_leaf(const bvh_builder& builder, uint32_t first, uint32_t count, int parent,
+                     const std::vector<uint32_t>& ids, const std::vector<aabb>& boxes) {
+        if (count == 1) {
+            uint32_t i = builder.indices[first];
+            int leaf = allocate_node();
+            leaf_of[ids[i]] = leaf;
+            nodes[leaf] = node{boxes[i], parent, {-1, -1}, ids[i]};
+            area_sum += contribution(leaf);
+            leaf_area_sum += boxes[i].surface_area();
+            return leaf;
+        }
+
+        int n = allocate_node();
+        int a = convert_leaf(builder, first, count / 2, n, ids, boxes);
+        int b = convert_leaf(builder, first + count / 2, count - count / 2, n, ids, boxes);
+        nodes[n] = node{aabb(nodes[a].box, nodes[b].box), parent, {a, b}, 0};
+        area_sum += contribution(n);
+        return n;
+    }
+
+    void rebuild_if_degraded() {
+        // A tree that has never been built (one started empty) takes the cost it has after its first insert (that of
+        // a single leaf, as good as a build) as the cost to compare with.
+        if (built_cost <= 0) {
+            built_cost = relative_cost();
+            built_count = object_count;
+            return;
+        }
+        if (rebuild_threshold > 0 && object_count > 1
+            && (object_count >= 2 * built_count || 2 * object_count <= built_count
+                || relative_cost() > rebuild_threshold * built_cost))
+            rebuild();
+    }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "color.h"
+
+#include <vector>
+
+
+// A rendered image held in memory: width x height linear colours in scanline order (top row first). The camera renders
+// into a framebuffer, and image_writer.h encodes it to a file in one go.
+class framebuffer {
+
+  public:
+
+    framebuffer(int width, int height) :
+      image_width(width),
+      image_height(height),
+      pixels(size_t(width) * height) {}
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+    size_t size() const { return pixels.size(); }
+
+    // Pixel by index in scanline order (= j * width + i).
+    color& operator[](size_t p) { return pixels[p]; }
+    const color& operator[](size_t p) const { return pixels[p]; }
+
+    // Pixel in column i of row j (row 0 is the top of the image).
+    color& at(int i, int j) { return pixels[size_t(j) * image_width + i]; }
+    const color& at(int i, int j) const { return pixels[size_t(j) * image_width + i]; }
+
+    std::vector<color>::const_iterator begin() const { return pixels.begin(); }
+    std::vector<color>::const_iterator end() const { return pixels.end(); }
+
+  private:
+    int image_width;
+    int image_height;
+    std::vector<color> pixels;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "aabb.h"
+#include "ray_packet.h"
 
 // Forward declaration of the material class (material class also uses hit_record).
 class material;
@@ -10,8 +11,9 @@ class hit_record {
   public:
     point3 p;                 // Point in space at which the hit occured
     vec3 normal;              // The surface normal at the hit point (convention: points against the ray direction)
-    shared_ptr<material> mat; // Shared pointer to a material object.
-    double t;                 // The distance, t, along the ray at which the hit occured
+    const material* mat;      // Non-owning pointer to the material hit. The hittable keeps the material alive (via a shared_ptr),
+                              // so copying a hit record never touches a reference count (an atomic shared between threads).
+    real t;                   // The distance, t, along the ray at which the hit occured
     bool front_face;          // Whether the ray intersects the sphere from inside or outside the sphere.
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
@@ -30,5 +32,19 @@ class hittable {
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    // Packet version of hit() for the rays of packet whose bits are set in active. Returns a mask of the rays that hit
+    // closer than their packet.t_max, for which packet.t_max and recs[i] are updated to the new closest hit.
+    // By default the rays are traced one at a time. Hittables that can do better (e.g. BVHs) override this.
+    virtual unsigned int hit_packet(ray_packet& packet, unsigned int active, hit_record recs[]) const {
+        unsigned int hits = 0;
+        for (int i = 0; i < ray_packet::size; i++) {
+            if ((active >> i & 1u) && hit(packet.get(i), interval(packet.t_min, packet.t_max[i]), recs[i])) {
+                packet.t_max[i] = recs[i].t;
+                hits |= 1u << i;
+            }
+        }
+        return hits;
+    }
+
     virtual aabb bounding_box() const = 0;
 };
\ No newline at end of file
@@ -47,6 +47,15 @@ class hittable_list : public hittable {
         return hit_anything;
     }
 
+    // Packets are passed to each object in turn. Each object only reports hits closer than those already found,
+    // because packet.t_max shrinks as hits are found.
+    unsigned int hit_packet(ray_packet& packet, unsigned int active, hit_record recs[]) const override {
+        unsigned int hits = 0;
+        for (const auto& object : objects)
+            hits |= object->hit_packet(packet, active, recs);
+        return hits;
+    }
+
     // Accessor for the hittable_list's bounding box object.
     aabb bounding_box() const override { return bbox; }
 
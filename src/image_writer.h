@@ -0,0 +1,240 @@
+#pragma once
+
+#include "color.h"
+#include "deflate.h"
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// File formats a framebuffer can be written in.
+enum class image_format {
+    ppm_text,       // Plain text PPM (P3), 8 bits per channel, gamma 2
+    ppm,            // Binary PPM (P6), 8 bits per channel, gamma 2
+    pfm,            // Portable float map: linear 32-bit floats, for compositing and tone mapping without quantisation
+    png             // PNG, 8 bits per channel, gamma 2
+};
+
+
+// Encodes a framebuffer in one of the image_formats. The whole file is built in memory and written with a single call,
+// rather than formatting each pixel through the stream.
+class image_writer {
+
+  public:
+
+    // Returns the file contents for image in the given format.
+    static std::string encode(const framebuffer& image, image_format format) {
+        switch (format) {
+            case image_format::ppm_text: return encode_ppm_text(image);
+            case image_format::ppm:      return encode_ppm(image);
+            case image_format::pfm:      return encode_pfm(image);
+            case image_format::png:      return encode_png(image);
+        }
+        return std::string();
+    }
+
+    static void write(std::ostream& out, const framebuffer& image, image_format format) {
+        std::string data = encode(image, format);
+        out.write(data.data(), std::streamsize(data.size()));
+        out.flush();
+    }
+
+    // Writes image to the file at path. Returns false if the file could not be written.
+    static bool write(const std::string& path, const framebuffer& image, image_format format) {
+        std::ofstream out(path, std::ios::binary);
+        write(out, image, format);
+        return bool(out);
+    }
+
+    // Usual file name extension of a format (including the dot).
+    static const char* file_extension(image_format format) {
+        switch (format) {
+            case image_format::ppm_text: return ".ppm";
+            case image_format::ppm:      return ".ppm";
+            case image_format::pfm:      return ".pfm";
+            case image_format::png:      return ".png";
+        }
+        return "";
+    }
+
+
+  private:
+
+    static std::string encode_ppm_text(const framebuffer& image) {
+        std::ostringstream out;
+        out << "P3\n" << image.width() << ' ' << image.height() << "\n255\n";
+        for (const auto& pixel_color : image)
+            write_color(out, pixel_color);
+        return out.str();
+    }
+
+    static std::string encode_ppm(const framebuffer& image) {
+        std::string data = "P6\n" + std::to_string(image.width()) + ' ' + std::to_string(image.height()) + "\n255\n";
+        size_t header_size = data.size();
+        data.resize(header_size + 3 * image.size());
+
+        unsigned char* bytes = reinterpret_cast<unsigned char*>(&data[header_size]);
+        for (size_t p = 0; p < image.size(); p++)
+            color_to_bytes(image[p], bytes + 3*p);
+        return data;
+    }
+
+    // PFM stores rows bottom to top; a negative scale in the header means little-endian floats.
+    static std::string encode_pfm(const framebuffer& image) {
+        std::string data = "PF\n" + std::to_string(image.width()) + ' ' + std::to_string(image.height()) + "\n-1.0\n";
+        size_t header_size = data.size();
+        data.resize(header_size + 12 * image.size());
+
+        unsigned char* bytes = reinterpret_cast<unsigned char*>(&data[header_size]);
+        for (int j = image.height() - 1; j >= 0; j--) {
+            for (int i = 0; i < image.width(); i++) {
+                const color& pixel_color = image.at(i, j);
+                for (int c = 0; c < 3; c++) {
+                    put_le32(bytes, float_bits(float(pixel_color[c])));
+                    bytes += 4;
+                }
+            }
+        }
+        return data;
+    }
+
+    static std::string encode_png(const framebuffer& image) {
+
+        // Each row is a filter type byte followed by the filtered RGB bytes (see choose_filter()).
+        const size_t row_size = 3 * size_t(image.width());
+        std::vector<unsigned char> raw(row_size * image.height());
+        for (size_t p = 0; p < image.size(); p++)
+            color_to_bytes(image[p], &raw[3*p]);
+
+        std::vector<unsigned char> filtered((row_size + 1) * image.height());
+        for (int j = 0; j < image.height(); j++) {
+            const unsigned char* row = &raw[row_size * j];
+            const unsigned char* above = j > 0 ? row - row_size : nullptr;
+            choose_filter(row, above, row_size, &filtered[(row_size + 1) * j]);
+        }
+
+        std::vector<unsigned char> compressed = zlib_compressor::compress(filtered.data(), filtered.size());
+
+        std::string data("\x89PNG\r\n\x1a\n", 8);
+
+        unsigned char header[13];
+        put_be32(header, uint32_t(image.width()));
+        put_be32(header + 4, uint32_t(image.height()));
+        header[8] = 8;          // Bits per channel
+        header[9] = 2;          // Colour type: RGB
+        header[10] = 0;         // Compression method: deflate
+        header[11] = 0;         // Filter method: adaptive
+        header[12] = 0;         // No interlacing
+
+        append_png_chunk(data, "IHDR", header, sizeof(header));
+        append_png_chunk(data, "IDAT", compressed.data(), compressed.size());
+        append_png_chunk(data, "IEND", nullptr, 0);
+        return data;
+    }
+
+
+    // Filters one row of a PNG with each of the filter types None, Sub, Up and Paeth and keeps the one with the smallest
+    // sum of absolute (signed) bytes, the usual guess at which will compress best. out receives the type byte followed
+    // by the filtered row.
+    static void choose_filter(const unsigned char* row, const unsigned char* above, size_t size, unsigned char* out) {
+
+        std::vector<unsigned char> trial(size);
+        long best_cost = -1;
+
+        for (int type = 0; type < 5; type++) {
+            if (type == 3)
+                continue;       // Average is rarely the best for rendered images
+
+            long cost = 0;
+            for (size_t k = 0; k < size; k++) {
+                int a = k >= 3 ? row[k-3] : 0;                      // Byte to the left
+                int b = above ? above[k] : 0;                       // Byte above
+                int c = (k >= 3 && above) ? above[k-3] : 0;         // Byte above and to the left
+
+                int predicted = 0;
+                if (type == 1)
+                    predicted = a;
+                else if (type == 2)
+                    predicted = b;
+                else if (type == 4)
+                    predicted = paeth(a, b, c);
+
+                trial[k] = (unsigned char)(row[k] - predicted);
+                cost += trial[k] < 128 ? trial[k] : 256 - trial[k];
+            }
+
+            if (best_cost < 0 || cost < best_cost) {
+                best_cost = cost;
+                out[0] = (unsigned char)type;
+                std::memcpy(out + 1, trial.data(), size);
+            }
+        }
+    }
+
+    static int paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = p > a ? p - a : a - p;
+        int pb = p > b ? p - b : b - p;
+        int pc = p > c ? p - c : c - p;
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+
+    // Appends a PNG chunk: length, type, data and the CRC of the type and data.
+    static void append_png_chunk(std::string& data, const char type[4], const unsigned char* chunk, size_t size) {
+        unsigned char length[4];
+        put_be32(length, uint32_t(size));
+        data.append(reinterpret_cast<const char*>(length), 4);
+
+        size_t start = data.size();
+        data.append(type, 4);
+        if (size > 0)
+            data.append(reinterpret_cast<const char*>(chunk), size);
+
+        unsigned char crc[4];
+        put_be32(crc, crc32(reinterpret_cast<const unsigned char*>(&data[start]), data.size() - start));
+        data.append(reinterpret_cast<const char*>(crc), 4);
+    }
+
+    static uint32_t crc32(const unsigned char* bytes, size_t size) {
+        static const std::vector<uint32_t> table = crc32_table();
+        uint32_t c = 0xffffffffu;
+        for (size_t k = 0; k < size; k++)
+            c = table[(c ^ bytes[k]) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffffu;
+    }
+
+    static std::vector<uint32_t> crc32_table() {
+        std::vector<uint32_t> table(256);
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        return table;
+    }
+
+    static uint32_t float_bits(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+
+    static void put_be32(unsigned char* bytes, uint32_t v) {
+        for (int k = 0; k < 4; k++)
+            bytes[k] = (unsigned char)(v >> (24 - 8*k));
+    }
+
+    static void put_le32(unsigned char* bytes, uint32_t v) {
+        for (int k = 0; k < 4; k++)
+            bytes[k] = (unsigned char)(v >> (8*k));
+    }
+};
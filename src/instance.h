@@ -0,0 +1,280 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "render_stats.h"
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+// An affine transform, p -> m*p + t: any combination of translation, scaling and rotation (and shear). Transforms are
+// combined with *, the right-hand one being applied first, so translation(v) * rotation(axis, angle) rotates an object
+// about its own origin and then moves it to v.
+class transform {
+
+  public:
+
+    real m[3][3];       // Linear part (row by row)
+    real t[3];          // Translation
+
+    // The identity.
+    transform() : m{{1,0,0}, {0,1,0}, {0,0,1}}, t{0,0,0} {}
+
+    static transform translation(const vec3& offset) {
+        transform x;
+        for (int i = 0; i < 3; i++)
+            x.t[i] = offset[i];
+        return x;
+    }
+
+    static transform scaling(const vec3& factors) {
+        transform x;
+        for (int i = 0; i < 3; i++)
+            x.m[i][i] = factors[i];
+        return x;
+    }
+
+    static transform scaling(real factor) { return scaling(vec3(factor, factor, factor)); }
+
+    // Rotation by degrees about an axis through the origin (counter-clockwise looking down the axis at the origin).
+    static transform rotation(const vec3& axis, double degrees) {
+        vec3 u = unit_vector(axis);
+        double c = std::cos(degrees_to_radians(degrees));
+        double s = std::sin(degrees_to_radians(degrees));
+
+        // Rodrigues' rotation formula: c*I + s*[u]x + (1-c)*u*u^T.
+        const double cross_matrix[3][3] = { {0, -u[2], u[1]}, {u[2], 0, -u[0]}, {-u[1], u[0], 0} };
+        transform x;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                x.m[i][j] = real((i == j ? c : 0) + s * cross_matrix[i][j] + (1 - c) * u[i] * u[j]);
+        return x;
+    }
+
+    point3 apply_point(const point3& p) const {
+        return point3(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + t[0],
+                      m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + t[1],
+                      m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + t[2]);
+    }
+
+    vec3 apply_vector(const vec3& v) const {
+        return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                    m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                    m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+    }
+
+    // Applies the transpose of the linear part. The transpose of a transform's inverse takes normals the way the
+    // transform itself takes points (keeping them perpendicular to surfaces that are scaled unevenly).
+    vec3 apply_transpose(const vec3& v) const {
+        return vec3(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                    m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                    m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+    }
+
+    // The transform that undoes this one (whose linear part must not be singular, e.g. a scaling by zero).
+    transform inverse() const {
+        // Inverse of the linear part by cofactors.
+        double cofactor[3][3];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) {
+                int i1 = (i+1) % 3, i2 = (i+2) % 3, j1 = (j+1) % 3, j2 = (j+2) % 3;
+                cofactor[i][j] = double(m[i1][j1])*m[i2][j2] - double(m[i1][j2])*m[i2][j1];
+            }
+        double det = m[0][0]*cofactor[0][0] + m[0][1]*cofactor[0][1] + m[0][2]*cofactor[0][2];
+
+        transform x;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                x.m[i][j] = real(cofactor[j][i] / det);
+
+        vec3 offset = x.apply_vector(vec3(t[0], t[1], t[2]));
+        for (int i = 0; i < 3; i++)
+            x.t[i] = -offset[i];
+        return x;
+    }
+
+    // Box enclosing the corners of box once transformed (Arvo's method: each output axis takes, from every input axis,
+    // whichever of its two ends gives the smaller or larger value).
+    aabb bounds(const aabb& box) const {
+        if (box.x.size() < 0 || box.y.size() < 0 || box.z.size() < 0)
+            return aabb::empty;
+
+        real lo[3], hi[3];
+        for (int i = 0; i < 3; i++) {
+            lo[i] = hi[i] = t[i];
+            for (int j = 0; j < 3; j++) {
+                real a = m[i][j] * box.axis_interval(j).min;
+                real b = m[i][j] * box.axis_interval(j).max;
+                lo[i] += std::min(a, b);
+                hi[i] += std::max(a, b);
+            }
+        }
+        return aabb(point3(lo[0], lo[1], lo[2]), point3(hi[0], hi[1], hi[2]));
+    }
+};
+
+inline transform operator*(const transform& a, const transform& b) {
+    transform x;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            x.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+        x.t[i] = a.m[i][0]*b.t[0] + a.m[i][1]*b.t[1] + a.m[i][2]*b.t[2] + a.t[i];
+    }
+    return x;
+}
+
+
+// Intersects ray r with object as placed in the world by a transform, given the transform's inverse, to_object. The
+// ray is moved into the object's own space instead of the object into the world. Its direction is not normalised
+// there, so distances along it are the same in both spaces and rec.t needs no conversion; only the hit point and the
+// normal are taken back to the world. A normal keeps its side of the surface (dot(normal, direction) is the same in
+// both spaces), so rec.front_face holds as the object set it.
+inline bool hit_transformed(const hittable& object, const transform& to_object, const ray& r, interval ray_t, hit_record& rec) {
+
+    ray object_ray(to_object.apply_point(r.origin()), to_object.apply_vector(r.direction()), r.time());
+    if (!object.hit(object_ray, ray_t, rec))
+        return false;
+
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(to_object.apply_transpose(rec.normal));
+    return true;
+}
+
+
+// A copy of an object (any hittable: a sphere, a sphere_set, a BVH of other objects) placed in the world by a
+// transform. The object is shared, not copied, so any number of instances of it cost little more than the object.
+class instance : public hittable {
+
+  public:
+
+    instance(shared_ptr<hittable> object, const transform& to_world) :
+      object(object),
+      to_object(to_world.inverse()),
+      bbox(to_world.bounds(object->bounding_box())) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return hit_transformed(*object, to_object, r, ray_t, rec);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    shared_ptr<hittable> object;
+    transform to_object;            // Inverse of the transform placing the object in the world
+    aabb bbox;                      // Bounding box in the world
+};
+
+
+// A two-level acceleration structure for scenes made of many copies of a few objects (e.g. a forest of a few kinds of
+// tree). Each distinct object is added once, with its own (bottom-level) BVH: a sphere_set or a linear_bvh, built by
+// the caller. The set keeps a (top-level) BVH over the placed copies, each of which is just the inverse of its
+// transform and the index of its object: 104 bytes in a double build and 52 in a float build, however large the
+// object. A ray finds the copies its path crosses in the top-level tree, then is moved into the space of each one
+// (see hit_transformed()) and traced through the object's own tree. Memory is therefore proportional to the unique
+// geometry plus a small record per copy, rather than to the total number of primitives in the scene.
+//
+// Add the copies, then call build() before rendering. Like sphere_set, the set is itself a hittable, and the objects
+// can themselves be instance_sets (a forest of copses of trees).
+class instance_set : public hittable {
+
+  public:
+
+    instance_set() {}
+
+    // Adds a copy of object, placed in the world by to_world. Copies of the same object share it.
+    void add(const shared_ptr<hittable>& object, const transform& to_world) {
+        placements.push_back(placement{to_world.inverse(), object_id(object)});
+        boxes.push_back(to_world.bounds(object->bounding_box()));
+    }
+
+    size_t size() const { return placements.size(); }
+    size_t object_count() const { return objects.size(); }
+
+
+    // Builds the top-level BVH over the copies and reorders them into leaf order. Must be called after the last add().
+    void build(const bvh_build_options& options = default_build_options()) {
+
+        bvh_builder builder(boxes, options);
+        nodes.swap(builder.nodes);
+        bbox = builder.bounds;
+        traversal_cost = options.traversal_cost;
+
+        std::vector<placement> reordered(placements.size());
+        for (size_t k = 0; k < placements.size(); k++)
+            reordered[k] = placements[builder.indices[k]];
+        placements.swap(reordered);
+
+        // The boxes are only needed to build the tree.
+        std::vector<aabb>().swap(boxes);
+    }
+
+    // An instance costs a whole traversal of its object's tree, so leaves are kept small.
+    static bvh_build_options default_build_options() {
+        bvh_build_options options;
+        options.split = bvh_split_method::sah;
+        options.max_leaf_size = 2;
+        options.traversal_cost = 0.5;
+        return options;
+    }
+
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+
+        return traverse_linear_bvh(nodes.data(), nodes.size(), r, ray_t, [&](uint32_t first, uint32_t count, real& closest_so_far) {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                RTW_STAT(primitive_tests, 1);
+                const placement& copy = placements[i];
+                if (hit_transformed(*object_list[copy.object], copy.to_object, r, interval(ray_t.min, closest_so_far), rec)) {
+                    hit_anything = true;
+                    closest_so_far = rec.t;
+                }
+            }
+            return hit_anything;
+        });
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Expected cost of a ray through the top-level tree (see bvh_sah_cost()), for comparing builders.
+    double sah_cost() const { return bvh_sah_cost(nodes, traversal_cost); }
+
+
+  private:
+
+    // A copy of an object: the inverse of the transform that places it, and the index of the object in objects.
+    struct placement {
+        transform to_object;
+        uint32_t object;
+    };
+
+    std::vector<placement> placements;                  // Copies, in leaf order once built
+    std::vector<shared_ptr<hittable>> objects;          // Distinct objects (keeps them alive)
+    std::vector<const hittable*> object_list;           // The same, non-owning, for traversal
+    std::unordered_map<const hittable*, uint32_t> object_index;
+    std::vector<aabb> boxes;                            // World boxes of the copies, until build()
+
+    std::vector<linear_bvh_node> nodes;                 // Top-level BVH over the copies (leaves index placements)
+    aabb bbox;
+    double traversal_cost = 1.0;                        // Node cost the tree was built with (relative to a copy)
+
+
+    uint32_t object_id(const shared_ptr<hittable>& object) {
+        auto found = object_index.find(object.get());
+        if (found != object_index.end())
+            return found->second;
+
+        uint32_t id = uint32_t(objects.size());
+        objects.push_back(object);
+        object_list.push_back(object.get());
+        object_index[object.get()] = id;
+        return id;
+    }
+};
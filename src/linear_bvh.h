@@ -0,0 +1,177 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// Finds the closest hit of ray r with the primitives of a linear BVH, within ray_t. The tree is traversed iteratively
+// with a small stack: children are visited nearest first, and subtrees further away than the closest hit found so far
+// are skipped. Primitives are tested by the caller's leaf(first, count, closest_so_far) function, which tests leaf
+// primitives [first, first+count), shrinks closest_so_far to any closer hit it finds and returns true if it found one.
+template <typename leaf_fn>
+inline bool traverse_linear_bvh(const linear_bvh_node* nodes, size_t node_count, const ray& r, interval ray_t, leaf_fn leaf) {
+
+    if (node_count == 0)
+        return false;
+
+    bool hit_anything = false;
+    auto closest_so_far = ray_t.max;
+
+    uint32_t stack[64];             // Nodes still to be visited (bvh_builder keeps trees within 64 levels)
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const linear_bvh_node& node = nodes[current];
+        RTW_STAT(node_visits, 1);
+
+        // Only descend into the node if its box is hit closer than the closest intersection found so far.
+        if (aabb::hit_slabs(r, node.bounds_min, node.bounds_max, interval(ray_t.min, closest_so_far))) {
+
+            if (node.is_leaf()) {
+                if (leaf(node.offset, uint32_t(node.count), closest_so_far))
+                    hit_anything = true;
+            } else if (r.dir_is_neg(node.axis)) {
+                // Ray travels towards -axis: the second child is nearer, so visit it first.
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+
+// A bounding volume hierarchy flattened into an array of linear_bvh_node, traversed by traverse_linear_bvh().
+// Unlike bvh_node, traversal needs no virtual calls or shared_ptr chasing until a leaf's primitives are tested.
+class linear_bvh : public hittable {
+
+  public:
+
+    static const int max_depth = 64;        // Size of the traversal stack
+
+    linear_bvh(const hittable_list& list, const bvh_build_options& options = bvh_build_options()) :
+      linear_bvh(list.objects, options) {}
+
+    linear_bvh(const std::vector<shared_ptr<hittable>>& objects, const bvh_build_options& options = bvh_build_options()) :
+      traversal_cost(options.traversal_cost)
+    {
+        // Build over the objects' bounding boxes.
+        std::vector<aabb> boxes;
+        boxes.reserve(objects.size());
+        for (const auto& object : objects)
+            boxes.push_back(object->bounding_box());
+
+        bvh_builder builder(boxes, options);
+        nodes.swap(builder.nodes);
+        bbox = builder.bounds;
+
+        // Store the primitives in leaf order, so that each leaf refers to a contiguous range.
+        owned.reserve(objects.size());
+        primitives.reserve(objects.size());
+        for (auto index : builder.indices) {
+            owned.push_back(objects[index]);
+            primitives.push_back(objects[index].get());
+        }
+    }
+
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+
+        return traverse_linear_bvh(nodes.data(), nodes.size(), r, ray_t, [&](uint32_t first, uint32_t count, real& closest_so_far) {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                if (primitives[i]->hit(r, interval(ray_t.min, closest_so_far), rec)) {
+                    hit_anything = true;
+                    closest_so_far = rec.t;
+                }
+            }
+            return hit_anything;
+        });
+    }
+
+
+    // Traces a packet of rays through the tree together. Each node's box is tested against all the rays at once
+    // (packet_hit_box()), and a subtree is entered if any ray that is still active hits it. Children are ordered by
+    // the direction of the first ray, as the rays of a packet are expected to travel in similar directions.
+    unsigned int hit_packet(ray_packet& packet, unsigned int active, hit_record recs[]) const override {
+
+        if (nodes.empty() || active == 0)
+            return 0;
+
+        int lead = 0;
+        while (!(active >> lead & 1u))
+            lead++;
+        const bool dir_is_neg[3] = { packet.inv_dir[0][lead] < 0, packet.inv_dir[1][lead] < 0, packet.inv_dir[2][lead] < 0 };
+
+        unsigned int hits = 0;
+
+        uint32_t stack[max_depth];      // Nodes still to be visited
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const linear_bvh_node& node = nodes[current];
+            RTW_STAT(node_visits, 1);
+            RTW_STAT(box_tests, render_stats::count_lanes(active));
+
+            // Rays that enter the node's box closer than their closest hit so far.
+            unsigned int node_active = active & packet_hit_box(packet, node.bounds_min, node.bounds_max);
+
+            if (node_active != 0) {
+
+                if (node.is_leaf()) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                        hits |= primitives[i]->hit_packet(packet, node_active, recs);
+                } else if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                    continue;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+
+        return hits;
+    }
+
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Expected cost of a ray through the tree (see bvh_sah_cost()), for comparing builders.
+    double sah_cost() const { return bvh_sah_cost(nodes, traversal_cost); }
+
+
+  private:
+    std::vector<linear_bvh_node> nodes;             // Depth-first flattened tree (nodes[0] is the root)
+    std::vector<const hittable*> primitives;        // Primitives in leaf order (non-owning, for traversal)
+    std::vector<shared_ptr<hittable>> owned;        // Keeps the primitives alive
+    aabb bbox;                                      // Bounding box of all primitives
+    double traversal_cost;                          // Node cost the tree was built with (relative to a primitive)
+};
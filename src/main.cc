@@ -1,23 +1,33 @@
 #include "rtweekend.h"
 
+#include "animation.h"
 #include "bvh.h"
 #include "camera.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "linear_bvh.h"
 #include "material.h"
+#include "scene_file.h"
 #include "sphere.h"
+#include "sphere_set.h"
 
 
 
-int main() {
+// The final scene of "Ray Tracing in One Weekend": a huge ground sphere, three large spheres and a grid of small spheres
+// of random materials, some of them moving. Rendered when no scene file is given.
+void book_scene(scene_description& scene) {
 
-    // World
-
-    hittable_list world;
+    scene.set_camera("aspect_ratio", 16.0 / 9.0);
+    scene.set_camera("vfov", 20);
+    scene.set_camera("lookfrom", point3(13,2,3));
+    scene.set_camera("lookat", point3(0,0,0));
+    scene.set_camera("vup", vec3(0,1,0));
+    scene.set_camera("defocus_angle", 0.6);
+    scene.set_camera("focus_dist", 10.0);
 
     // Create a very large sphere to represent the ground
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
+    auto ground_material = scene.add_material(material_description::lambertian_material(color(0.5, 0.5, 0.5)), "ground");
+    scene.add_sphere(point3(0,-1000,0), point3(0,-1000,0), 1000, ground_material);
 
     // a and b are the x and z coordinates of sphere centres. Random noise will be added.
     for (int a = -11; a < 11; a++) {
@@ -31,64 +41,168 @@ int main() {
 
             // This if statement leaves an exclusion zone for the 3 large spheres also added later.
             if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
 
                 // Add a sphere at position, center, with material chosen by a random weighting function.
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    //world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    auto sphere_material = scene.add_material(material_description::lambertian_material(albedo));
                     auto center2 = center + vec3(0, random_double(0,.5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                    scene.add_sphere(center, center2, 0.2, sphere_material);
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    auto sphere_material = scene.add_material(material_description::metal_material(albedo, fuzz));
+                    scene.add_sphere(center, center, 0.2, sphere_material);
                 } else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    auto sphere_material = scene.add_material(material_description::dielectric_material(1.5));
+                    scene.add_sphere(center, center, 0.2, sphere_material);
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = scene.add_material(material_description::dielectric_material(1.5), "glass");
+    scene.add_sphere(point3(0, 1, 0), point3(0, 1, 0), 1.0, material1);
+
+    auto material2 = scene.add_material(material_description::lambertian_material(color(0.4, 0.2, 0.1)), "brown");
+    scene.add_sphere(point3(-4, 1, 0), point3(-4, 1, 0), 1.0, material2);
+
+    auto material3 = scene.add_material(material_description::metal_material(color(0.7, 0.6, 0.5), 0.0), "mirror");
+    scene.add_sphere(point3(4, 1, 0), point3(4, 1, 0), 1.0, material3);
+}
+
+
+int main(int argc, char** argv) {
+
+    // Command line: theNextWeek [scene file] [--save <scene file>] [--bvh-cache <directory>]
+    //                          [--farm-workers <count>] [--farm-port <port>] [--farm-tile-timeout <seconds>]
+    //                          [--worker <host:port>] [--frames <count>]
+    std::string scene_path, save_path, bvh_cache_dir, coordinator;
+    int farm_workers = 0, farm_port = 0, frames = 0;
+    double farm_tile_timeout = 60;
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+        if (arg == "--save" && k + 1 < argc)
+            save_path = argv[++k];
+        else if (arg == "--bvh-cache" && k + 1 < argc)
+            bvh_cache_dir = argv[++k];
+        else if (arg == "--farm-workers" && k + 1 < argc)
+            farm_workers = std::atoi(argv[++k]);
+        else if (arg == "--farm-port" && k + 1 < argc)
+            farm_port = std::atoi(argv[++k]);
+        else if (arg == "--farm-tile-timeout" && k + 1 < argc)
+            farm_tile_timeout = std::atof(argv[++k]);
+        else if (arg == "--worker" && k + 1 < argc)
+            coordinator = argv[++k];
+        else if (arg == "--frames" && k + 1 < argc)
+            frames = std::atoi(argv[++k]);
+        else if (arg[0] != '-' && scene_path.empty())
+            scene_path = arg;
+        else {
+            std::cerr << "Usage: " << argv[0] << " [scene file] [--save <scene file>] [--bvh-cache <directory>]"
+                      << " [--farm-workers <count>] [--farm-port <port>] [--farm-tile-timeout <seconds>]"
+                      << " [--worker <host:port>] [--frames <count>]\n";
+            return 1;
+        }
+    }
+
+
+    // World
+
+    scene_description scene;
+    if (scene_path.empty()) {
+        book_scene(scene);
+    } else {
+        render_stats::phase_scope phase("load scene");
+        std::string error;
+        if (!scene_file::read(scene_path, scene, error)) {
+            std::cerr << "Could not load scene " << scene_path << ": " << error << '\n';
+            return 1;
+        }
+        std::clog << "Loaded " << scene.sphere_count() << " spheres and " << scene.materials.size() << " materials\n";
+    }
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    // With --save, write the scene out (in binary if the file name ends in .bin, otherwise as text) instead of rendering.
+    if (!save_path.empty()) {
+        bool binary = save_path.size() >= 4 && save_path.compare(save_path.size() - 4, 4, ".bin") == 0;
+        if (!(binary ? scene_file::write_binary(save_path, scene) : scene_file::write_text(save_path, scene))) {
+            std::cerr << "Could not write scene " << save_path << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    // The spheres are stored together in a sphere_set (rather than as separate sphere objects), which has its own bvh.
+    auto spheres = make_shared<sphere_set>();
+    uint64_t scene_key = scene.content_key();
+    scene.move_into(*spheres);
+
+    // Build the sphere_set's (flattened) bvh. The surface area heuristic gives a much better tree than median splits for
+    // a scene with one huge ground sphere. With --bvh-cache the tree is kept in a file in that directory, so later runs of
+    // the same scene map it rather than building it again.
+    bvh_build_options bvh_options;
+    bvh_options.split         = bvh_split_method::sah;
+    bvh_options.max_leaf_size = 4;
+
+    {
+        render_stats::phase_scope phase("bvh build");
+        spheres->build(bvh_options, bvh_cache_dir);
+    }
+    std::clog << "BVH: " << spheres->node_count() << " nodes, SAH cost " << spheres->sah_cost()
+              << (spheres->bvh_from_cache() ? " (from cache)" : "")
+              << (spheres->uses_motion_bvh() ? ", boxes interpolated over time" : "") << '\n';
 
-    // Restructure the current hittable_list into a bvh. Although the bvh is a single root node that is traversed,
-    // add it to a new hittable_list so that other items can be added.
-    world = hittable_list(make_shared<bvh_node>(world));
+    // Add the sphere_set to a hittable_list so that other items can be added.
+    hittable_list world(spheres);
 
 
     // camera
 
     camera cam;
 
-    cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 800;
     cam.samples_per_pixel = 250;
     cam.max_depth         = 50;
 
-    cam.vfov     = 20;
-    cam.lookfrom = point3(13,2,3);
-    cam.lookat   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
+    // The view (and any of the settings above) come from the scene.
+    scene.apply(cam);
+
+    // Only written by builds with RTW_STATS (see render_stats.h).
+    cam.stats_heatmap_file = "heatmap.ppm";
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist    = 10.0;
+    // With --farm-workers and/or --farm-port, this process coordinates a distributed render; with --worker, it renders
+    // tiles for the coordinator at that address (which must have the same scene) instead of writing an image.
+    cam.farm_workers = farm_workers;
+    cam.farm_port    = farm_port;
+    cam.farm_tile_timeout = farm_tile_timeout;
+    cam.scene_key    = scene_key;
+    if (!coordinator.empty())
+        return cam.serve(world, coordinator) ? 0 : 1;
 
 
     // Render
 
+    // With --frames, an animation is rendered instead of a single image: the time from 0 to 1 (over which the moving
+    // spheres make their jump) is split into that many frames, while the camera swings 30 degrees around the point it
+    // looks at. The frames are written to frame_0000.ppm, frame_0001.ppm, ...
+    if (frames > 0) {
+        animation anim;
+        anim.frame_count = frames;
+        anim.frame_time  = 1.0 / frames;
+
+        vec3 offset = cam.lookfrom - cam.lookat;
+        double angle = degrees_to_radians(30);
+        vec3 swung(offset.x()*std::cos(angle) + offset.z()*std::sin(angle), offset.y(),
+                   offset.z()*std::cos(angle) - offset.x()*std::sin(angle));
+        anim.add_key(0, cam.lookfrom, cam.lookat, cam.vfov);
+        anim.add_key(1, cam.lookat + swung, cam.lookat, cam.vfov);
+
+        anim.render(cam, *spheres, world);
+        return 0;
+    }
+
     cam.render(world);
-}
\ No newline at end of file
+}
@@ -3,6 +3,16 @@
 #include "hittable.h"
 
 
+// The concrete material classes. Lets code that handles many hits at once (e.g. the wavefront integrator) group them
+// by material type and call each type's scatter() without virtual dispatch.
+enum class material_type {
+    other,              // Any other material: scatter() is called virtually
+    lambertian,
+    metal,
+    dielectric
+};
+
+
 // Abstract base class for materials
 class material {
 
@@ -10,6 +20,8 @@ class material {
 
     virtual ~material() = default;
 
+    virtual material_type type() const { return material_type::other; }
+
     // Base function absorbs the incoming ray by default (return false)
     virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const {
         return false;
@@ -23,6 +35,8 @@ class lambertian : public material {
     public:
 
       lambertian(const color& albedo) : albedo(albedo) {}
+
+      material_type type() const override { return material_type::lambertian; }
   
       // Overriding scatter function
       bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
@@ -51,6 +65,8 @@ class metal : public material {
             albedo(albedo), 
             fuzz(fuzz < 1 ? fuzz : 1) {}
 
+        material_type type() const override { return material_type::metal; }
+
         bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
 
             // Direction of reflected ray
@@ -77,6 +93,8 @@ class dielectric : public material {
     public:
 
         dielectric(double refraction_index) : refraction_index(refraction_index) {}
+
+        material_type type() const override { return material_type::dielectric; }
     
 
         bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override {
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+// A node of a linear BVH over moving primitives: its box at the start (time0) and at the end (time1) of a time
+// window, rather than a single box enclosing the primitives over the whole window. A ray at time t is tested against
+// the box interpolated to t, which encloses the primitives at that moment and, when they move far, is much smaller
+// than the box of the whole window (which every ray would otherwise have to test, whatever its time).
+//
+// This holds for primitives that move in a straight line at a steady speed (as spheres do): each primitive's box
+// moves linearly, so the interpolated box of a node encloses its primitives' boxes at any time in the window. The
+// bounds are single precision, rounded outwards and then padded a little further, so that interpolating them in
+// single precision never cuts into a primitive. The tree's structure (offset, count, axis) is that of linear_bvh_node.
+struct motion_bvh_node {
+    float    bounds_min[3];     // Minimum x,y,z of the node's box at time0
+    float    bounds_max[3];     // Maximum x,y,z of the node's box at time0
+    float    end_min[3];        // Minimum x,y,z of the node's box at time1
+    float    end_max[3];        // Maximum x,y,z of the node's box at time1
+    uint32_t offset;            // Leaf: index of first primitive. Interior: index of second child.
+    uint16_t count;             // Number of primitives in a leaf (0 for an interior node)
+    uint8_t  axis;              // Axis the interior node was split along
+    uint8_t  pad;
+    uint32_t pad2[2];           // To a full cache line
+
+    bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(motion_bvh_node) == 64, "motion_bvh_node should be 64 bytes");
+
+
+// Makes the motion_bvh_nodes of a linear BVH, for the time window [time0, time1]. leaf_box(first, count, time) returns
+// the box of a leaf's primitives at a time. The two ends of the window are refitted separately (with num_threads
+// threads, see refit_linear_bvh()) and then combined.
+template <typename leaf_box_fn>
+inline std::vector<motion_bvh_node> make_motion_bvh(const linear_bvh_node* nodes, size_t node_count,
+                                                    double time0, double time1, leaf_box_fn leaf_box, int num_threads = 1) {
+
+    std::vector<linear_bvh_node> start(nodes, nodes + node_count);
+    std::vector<linear_bvh_node> end(nodes, nodes + node_count);
+    refit_linear_bvh(start.data(), start.size(), [&](uint32_t first, uint32_t count) { return leaf_box(first, count, time0); }, num_threads);
+    refit_linear_bvh(end.data(), end.size(), [&](uint32_t first, uint32_t count) { return leaf_box(first, count, time1); }, num_threads);
+
+    // Interpolating between a and b in single precision is out by at most a few units in the last place of the larger
+    // of the two, so the bounds are moved apart by a bit more than that.
+    auto padding = [](float a, float b) { return std::max(std::fabs(a), std::fabs(b)) * 1e-6f; };
+
+    std::vector<motion_bvh_node> motion_nodes(node_count);
+    for (size_t k = 0; k < node_count; k++) {
+        motion_bvh_node& node = motion_nodes[k];
+        for (int axis = 0; axis < 3; axis++) {
+            float pad_min = padding(start[k].bounds_min[axis], end[k].bounds_min[axis]);
+            float pad_max = padding(start[k].bounds_max[axis], end[k].bounds_max[axis]);
+            node.bounds_min[axis] = start[k].bounds_min[axis] - pad_min;
+            node.bounds_max[axis] = start[k].bounds_max[axis] + pad_max;
+            node.end_min[axis]    = end[k].bounds_min[axis] - pad_min;
+            node.end_max[axis]    = end[k].bounds_max[axis] + pad_max;
+        }
+        node.offset = nodes[k].offset;
+        node.count  = nodes[k].count;
+        node.axis   = nodes[k].axis;
+        node.pad    = 0;
+        node.pad2[0] = node.pad2[1] = 0;
+    }
+    return motion_nodes;
+}
+
+
+// How much smaller the interpolated boxes of a motion tree are than the boxes of the whole window (window_nodes, the
+// same tree as a linear BVH): the ratio of the area of each node's box at a ray's time, averaged over the window, to
+// the area of its window box, averaged over the nodes weighted by their cost (traversal_cost for an interior node, the
+// number of primitives for a leaf). The sides of an interpolated box change linearly, so its area is quadratic in
+// time and Simpson's rule gives the average exactly.
+//
+// This is an estimate of the fraction of node visits and primitive tests left with the interpolated boxes. Unlike a
+// SAH cost (see bvh_sah_cost()) it is not swamped by the largest boxes: a huge ground sphere, for example, leaves
+// every other box's area negligible next to the root's.
+inline double motion_bvh_shrinkage(const motion_bvh_node* nodes, const linear_bvh_node* window_nodes, size_t node_count,
+                                   double traversal_cost) {
+
+    auto area_at = [](const motion_bvh_node& node, double u) {
+        double d[3];
+        for (int axis = 0; axis < 3; axis++) {
+            double lo = node.bounds_min[axis] + u * (node.end_min[axis] - node.bounds_min[axis]);
+            double hi = node.bounds_max[axis] + u * (node.end_max[axis] - node.bounds_max[axis]);
+            d[axis] = std::max(0.0, hi - lo);
+        }
+        return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+    };
+
+    double weighted_ratio = 0, total_weight = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        const motion_bvh_node& node = nodes[i];
+        double window_area = window_nodes[i].bounds().surface_area();
+        if (window_area <= 0)
+            continue;
+
+        double weight = node.is_leaf() ? double(node.count) : traversal_cost;
+        double mean_area = (area_at(node, 0) + 4 * area_at(node, 0.5) + area_at(node, 1)) / 6;
+        weighted_ratio += weight * std::min(1.0, mean_area / window_area);
+        total_weight += weight;
+    }
+    return total_weight > 0 ? weighted_ratio / total_weight : 1.0;
+}
+
+
+// As traverse_linear_bvh(), testing the ray against each node's box at the ray's time: u is the ray's time as a
+// fraction of the way through the nodes' time window (0 at time0, 1 at time1).
+template <typename leaf_fn>
+inline bool traverse_motion_bvh(const motion_bvh_node* nodes, size_t node_count, const ray& r, interval ray_t, float u, leaf_fn leaf) {
+
+    if (node_count == 0)
+        return false;
+
+    bool hit_anything = false;
+    auto closest_so_far = ray_t.max;
+
+    uint32_t stack[64];             // Nodes still to be visited (bvh_builder keeps trees within 64 levels)
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const motion_bvh_node& node = nodes[current];
+        RTW_STAT(node_visits, 1);
+
+        float box_min[3], box_max[3];
+        for (int axis = 0; axis < 3; axis++) {
+            box_min[axis] = node.bounds_min[axis] + u * (node.end_min[axis] - node.bounds_min[axis]);
+            box_max[axis] = node.bounds_max[axis] + u * (node.end_max[axis] - node.bounds_max[axis]);
+        }
+
+        // Only descend into the node if its box is hit closer than the closest intersection found so far.
+        if (aabb::hit_slabs(r, box_min, box_max, interval(ray_t.min, closest_so_far))) {
+
+            if (node.is_leaf()) {
+                if (leaf(node.offset, uint32_t(node.count), closest_so_far))
+                    hit_anything = true;
+            } else if (r.dir_is_neg(node.axis)) {
+                // Ray travels towards -axis: the second child is nearer, so visit it first.
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+// Running estimate of a pixel's colour from its samples so far: the mean and variance are updated one sample at a time
+// with Welford's algorithm, which stays accurate however many samples are added (unlike summing the squares).
+struct pixel_estimate {
+
+    int   count = 0;                // Number of samples so far
+    color mean  = color(0,0,0);     // Mean colour of the samples
+    color m2    = color(0,0,0);     // Sum of squared differences from the mean, per channel
+
+    void add(const color& sample) {
+        count++;
+        color delta = sample - mean;
+        mean += delta / count;
+        m2 += delta * (sample - mean);
+    }
+
+    // Unbiased sample variance of each channel (zero until there are two samples).
+    color variance() const {
+        return count > 1 ? m2 / (count - 1) : color(0,0,0);
+    }
+
+    // Half-width of the (approximately) 95% confidence interval of the mean, for the noisiest channel.
+    double error() const {
+        if (count < 2)
+            return infinity;
+        color v = variance();
+        return 1.96 * std::sqrt(std::max(v.x(), std::max(v.y(), v.z())) / count);
+    }
+
+    // Whether the mean is known to within threshold of the pixel's brightness (its brightest channel). The small floor
+    // on brightness stops near-black pixels from needing an impossibly small error.
+    bool converged(double threshold) const {
+        double brightness = std::max(mean.x(), std::max(mean.y(), mean.z()));
+        return error() <= threshold * (brightness + 0.01);
+    }
+};
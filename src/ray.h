@@ -2,31 +2,45 @@
 
 #include "vec3.h"
 
-// _ray(t) = _origin + t*_direction
-class ray {
+// _ray(t) = _origin + t*_direction, with components of scalar type T. The renderer uses basic_ray<real> (ray).
+template <typename T>
+class basic_ray {
   public:
-    ray() {}
+    using vec_type = basic_vec3<T>;
 
-    ray(const point3& origin, const vec3& direction, double time) :           // Sets up a ray and keeps track of time that it was fired
+    basic_ray() {}
+
+    basic_ray(const vec_type& origin, const vec_type& direction, T time) :           // Sets up a ray and keeps track of time that it was fired
       orig(origin), 
       dir(direction),
-      tm(time) {}
+      inv_dir(T(1) / direction.x(), T(1) / direction.y(), T(1) / direction.z()),
+      tm(time),
+      sign_bits((inv_dir.x() < 0 ? 1 : 0) | (inv_dir.y() < 0 ? 2 : 0) | (inv_dir.z() < 0 ? 4 : 0)) {}
     
-    ray(const point3& origin, const vec3& direction) :                        // Constructor without time specified assumes time = 0
-      ray(origin, direction, 0.0) {}
+    basic_ray(const vec_type& origin, const vec_type& direction) :            // Constructor without time specified assumes time = 0
+      basic_ray(origin, direction, 0) {}
+
+    const vec_type& origin() const  { return orig; }
+    const vec_type& direction() const { return dir; }
 
-    const point3& origin() const  { return orig; }
-    const vec3& direction() const { return dir; }
+    T time() const { return tm; }                                        // Return time that the ray was fired
 
-    double time() const { return tm; }                                        // Return time that the ray was fired
+    // The inverse direction and the direction signs are computed once, when the ray is made, and then reused by
+    // every bounding box the ray is tested against.
+    const vec_type& inv_direction() const { return inv_dir; }                     // (1/dx, 1/dy, 1/dz)
+    bool dir_is_neg(int axis) const { return (sign_bits >> axis) & 1; }       // Whether the ray travels towards -axis
 
     // Return a point along the ray
-    point3 at(double t) const {
+    vec_type at(T t) const {
         return orig + t*dir;
     }
 
   private:
-    point3 orig;
-    vec3 dir;
-    double tm;      // Time at which the ray was fired in [0, 1]
-};
\ No newline at end of file
+    vec_type orig;
+    vec_type dir;
+    vec_type inv_dir;   // Reciprocal of each direction component (infinite for a zero component)
+    T tm;               // Time at which the ray was fired in [0, 1]
+    int sign_bits;      // Bit i is set if direction component i is negative
+};
+
+using ray = basic_ray<real>;
\ No newline at end of file
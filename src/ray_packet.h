@@ -0,0 +1,92 @@
+#pragma once
+
+#include "interval.h"
+#include "ray.h"
+
+#include <algorithm>
+
+
+// Functions marked RTW_SIMD_CLONES are compiled several times (AVX-512, AVX2 and baseline SSE2) and the version
+// matching the CPU is picked when the program starts. Their loops over the lanes of a packet are written so that the
+// compiler can vectorise them for each instruction set.
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define RTW_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+
+#ifndef RTW_SIMD_CLONES
+#define RTW_SIMD_CLONES
+#endif
+
+
+// A packet of rays that are traced together through the scene. Neighbouring primary rays travel in almost the same
+// direction, so they visit almost the same BVH nodes: testing all of them against a node at once (with SIMD) shares
+// the cost of fetching the node and of the traversal logic.
+//
+// The rays are stored structure-of-arrays (one array per component) so that each lane of a SIMD register holds one
+// ray. 8 lanes of doubles fill one AVX-512 register, two AVX2 registers or four SSE2 registers (8 lanes of floats, in
+// a float build, fill one AVX2 register).
+struct ray_packet {
+
+    static const int size = 8;                      // Rays per packet
+
+    real orig[3][size];                           // Ray origins, by axis
+    real dir[3][size];                            // Ray directions, by axis
+    real inv_dir[3][size];                        // 1 / direction, by axis
+    real time[size];                              // Time at which each ray was fired
+    real t_min;                                   // Start of the valid intersection interval (shared by all rays)
+    real t_max[size];                             // End of each ray's valid interval: shrinks to the closest hit found
+
+    explicit ray_packet(real t_min) : t_min(t_min) {
+        for (int i = 0; i < size; i++) {
+            for (int axis = 0; axis < 3; axis++)
+                orig[axis][i] = dir[axis][i] = inv_dir[axis][i] = 0;
+            time[i] = 0;
+            t_max[i] = -infinity;                   // Unused lanes never hit anything
+        }
+    }
+
+    // Places ray r in lane i, valid over (t_min, t_max).
+    void set(int i, const ray& r, real t_max) {
+        for (int axis = 0; axis < 3; axis++) {
+            orig[axis][i] = r.origin()[axis];
+            dir[axis][i] = r.direction()[axis];
+            inv_dir[axis][i] = r.inv_direction()[axis];
+        }
+        time[i] = r.time();
+        this->t_max[i] = t_max;
+    }
+
+    // The ray in lane i.
+    ray get(int i) const {
+        return ray(point3(orig[0][i], orig[1][i], orig[2][i]), vec3(dir[0][i], dir[1][i], dir[2][i]), time[i]);
+    }
+};
+
+// Slab test of every ray of a packet against one box. Returns a mask with bit i set if ray i enters the box within
+// (t_min, t_max[i]).
+RTW_SIMD_CLONES
+inline unsigned int packet_hit_box(const ray_packet& p, const float box_min[3], const float box_max[3]) {
+
+    bool hits[ray_packet::size];
+
+    for (int i = 0; i < ray_packet::size; i++) {
+        real t_enter = p.t_min;
+        real t_exit = p.t_max[i];
+
+        for (int axis = 0; axis < 3; axis++) {
+            real t0 = (box_min[axis] - p.orig[axis][i]) * p.inv_dir[axis][i];
+            real t1 = (box_max[axis] - p.orig[axis][i]) * p.inv_dir[axis][i];
+            t_enter = std::max(t_enter, std::min(t0, t1));
+            t_exit  = std::min(t_exit,  std::max(t0, t1));
+        }
+
+        hits[i] = t_enter < t_exit;
+    }
+
+    unsigned int mask = 0;
+    for (int i = 0; i < ray_packet::size; i++)
+        mask |= unsigned(hits[i]) << i;
+    return mask;
+}
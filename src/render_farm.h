@@ -0,0 +1,674 @@
+#pragma once
+
+#include "color.h"
+#include "framebuffer.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+// Rendering a frame across several processes, possibly on several machines. A coordinator (render_farm) hands out
+// tiles, each with a range of samples, to worker processes and copies the pixel sums they send back into its image.
+// Workers are local processes forked by the coordinator (connected to it by a socket pair), or processes on other
+// machines that load the same scene and connect to the coordinator's TCP port (see camera::serve()).
+//
+// Every pixel sample seeds its own random numbers (see sampler.h), so a tile's pixels are the same whichever worker
+// renders them, and the merged image is the same as one rendered in a single process. If a worker is lost (it exits
+// or its connection drops), the tiles it was rendering are handed out again; if every worker is lost, the coordinator
+// renders the remaining tiles itself. The coordinator never waits on one worker: a new connection that does not say
+// hello within hello_timeout seconds is closed, and a worker that has not returned a tile by its deadline (see
+// tile_timeout) is dropped as lost, so a worker that hangs without closing its connection cannot stall the frame. Each
+// time a worker is dropped for being late the deadline is doubled, so that a render whose tiles simply take longer than
+// tile_timeout still finishes, rather than handing the same tiles out again and again.
+//
+// The protocol is a stream of fixed-size messages in native byte order, so all the processes must run the same build
+// on machines of the same architecture:
+//   worker -> coordinator   farm_hello once, on connecting
+//   coordinator -> worker   farm_job per tile (a negative tile index asks the worker to exit)
+//   worker -> coordinator   farm_result per tile, followed by the tile's pixels as 3 doubles each (in scanline order)
+//
+// Only POSIX systems are supported; elsewhere render_farm::supported is false and the camera renders in process.
+
+struct farm_hello {
+    char     magic[8];          // "RTWFARM1"
+    uint32_t version;
+    int32_t  threads;           // Number of tiles the worker renders at a time
+    uint64_t key;               // Hash of the scene and render settings, which must match the coordinator's
+};
+
+struct farm_job {
+    int32_t tile_index;         // Negative to ask the worker to exit
+    int32_t x0, y0, x1, y1;
+    int32_t sample0, sample1;   // Samples [sample0, sample1) of each pixel are rendered
+    double  scale;              // Factor the sum of each pixel's samples is multiplied by
+};
+
+struct farm_result {
+    int32_t tile_index;
+    int32_t pixels;             // Number of pixels that follow
+};
+
+
+class render_farm {
+
+  public:
+
+#ifndef _WIN32
+    static const bool supported = true;
+#else
+    static const bool supported = false;
+#endif
+
+    static const uint32_t protocol_version = 1;
+
+    double hello_timeout = 10;      // Seconds a new connection has to say hello before it is closed
+    double tile_timeout  = 60;      // Seconds a worker has to return a tile, or 8 times the slowest tile so far if longer (0 = no limit)
+    double io_timeout    = 10;      // Seconds a message already under way may take to arrive or be sent
+
+    // key identifies the scene and render settings: workers that connect with a different key are turned away.
+    explicit render_farm(uint64_t key) : key(key) {}
+
+    ~render_farm() {
+#ifndef _WIN32
+        farm_job quit = farm_job();
+        quit.tile_index = -1;
+        for (auto& w : workers) {
+            if (w.fd >= 0) {
+                send_all(w.fd, &quit, sizeof(quit));
+                ::close(w.fd);
+            }
+        }
+        if (listen_fd >= 0)
+            ::close(listen_fd);
+        for (auto& g : greetings)
+            ::close(g.fd);
+        for (auto& w : workers)
+            if (w.pid > 0)
+                ::waitpid(w.pid, nullptr, 0);
+        for (auto& g : greetings)
+            if (g.pid > 0)
+                ::waitpid(g.pid, nullptr, 0);
+#endif
+    }
+
+    render_farm(const render_farm&) = delete;
+    render_farm& operator=(const render_farm&) = delete;
+
+    int live_workers() const {
+        int n = 0;
+        for (const auto& w : workers)
+            n += (w.fd >= 0);
+        return n;
+    }
+
+
+    // Forks count local worker processes, each of which calls serve(fd) with its end of a socket pair and then exits.
+    // Returns false if no worker could be started. Must be called before the calling process starts any threads.
+    bool start_local_workers(int count, const std::function<void(int)>& serve) {
+#ifndef _WIN32
+        for (int k = 0; k < count; k++) {
+            int fds[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                break;
+
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                ::close(fds[0]);
+                ::close(fds[1]);
+                break;
+            }
+
+            if (pid == 0) {
+                // The worker: keep only its own end of its own socket pair, so that the coordinator (and the other
+                // workers) see a connection drop when the process holding the other end goes away.
+                ::close(fds[0]);
+                for (auto& w : workers)
+                    if (w.fd >= 0)
+                        ::close(w.fd);
+                for (auto& g : greetings)
+                    ::close(g.fd);
+                if (listen_fd >= 0)
+                    ::close(listen_fd);
+                serve(fds[1]);
+                ::_exit(0);
+            }
+
+            ::close(fds[1]);
+            begin_greeting(fds[0], pid);
+        }
+
+        // Wait for the new workers' hellos (or for them to time out).
+        while (!greetings.empty()) {
+            std::vector<pollfd> fds;
+            for (const auto& g : greetings)
+                fds.push_back(pollfd{g.fd, POLLIN, 0});
+            ::poll(fds.data(), nfds_t(fds.size()), poll_timeout_ms(clock::time_point::max()));
+            read_greetings(fds);
+        }
+#else
+        (void)count;
+        (void)serve;
+#endif
+        return live_workers() > 0;
+    }
+
+
+    // Accepts remote workers on a TCP port (on every interface). They are taken on whenever they connect, including
+    // part way through a render.
+    bool listen_on(int port) {
+#ifndef _WIN32
+        listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0)
+            return false;
+
+        int yes = 1;
+        ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(uint16_t(port));
+
+        if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listen_fd, 16) != 0) {
+            ::close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        return true;
+#else
+        (void)port;
+        return false;
+#endif
+    }
+
+
+    // Renders samples [sample0, sample1) of the given tiles across the workers, storing scale times the sum of each
+    // pixel's samples in image. Tiles left with no worker to render them are passed to render_locally(tile).
+    void run(const std::vector<tile>& tiles, int sample0, int sample1, double scale, framebuffer& image,
+             const std::function<void(const tile&)>& render_locally) {
+#ifndef _WIN32
+        std::deque<int> pending;
+        for (int t = 0; t < int(tiles.size()); t++)
+            pending.push_back(t);
+
+        int remaining = int(tiles.size());
+        std::vector<double> pixel_data;
+
+        while (remaining > 0) {
+
+            // Keep every worker busy with as many tiles as it renders at a time.
+            for (int w = 0; w < int(workers.size()); w++) {
+                worker_state& worker = workers[w];
+                while (worker.fd >= 0 && int(worker.tiles.size()) < worker.threads && !pending.empty()) {
+                    int t = pending.front();
+                    farm_job job = { tiles[t].index, tiles[t].x0, tiles[t].y0, tiles[t].x1, tiles[t].y1, sample0, sample1, scale };
+                    if (!send_all(worker.fd, &job, sizeof(job))) {
+                        lose_worker(w, pending);
+                        break;
+                    }
+                    pending.pop_front();
+                    worker.tiles.push_back(t);
+                    worker.sent.push_back(clock::now());
+                }
+            }
+
+            // With no workers left, the coordinator renders a tile itself (and then checks for new workers).
+            if (live_workers() == 0) {
+                int t = pending.front();
+                pending.pop_front();
+                render_locally(tiles[t]);
+                report_progress(--remaining);
+                accept_workers();
+                std::vector<pollfd> fds;
+                for (const auto& g : greetings)
+                    fds.push_back(pollfd{g.fd, POLLIN, 0});
+                if (!fds.empty() && ::poll(fds.data(), nfds_t(fds.size()), 0) >= 0)
+                    read_greetings(fds);
+                continue;
+            }
+
+            // Wait for results, new workers or hellos, but no later than the earliest tile deadline.
+            clock::time_point deadline = clock::time_point::max();
+            for (const auto& worker : workers)
+                for (const auto& sent : worker.sent)
+                    if (tile_timeout > 0)
+                        deadline = std::min(deadline, sent + tile_time_limit());
+
+            std::vector<pollfd> fds;
+            std::vector<int> fd_worker;
+            for (int w = 0; w < int(workers.size()); w++) {
+                if (workers[w].fd >= 0) {
+                    fds.push_back(pollfd{workers[w].fd, POLLIN, 0});
+                    fd_worker.push_back(w);
+                }
+            }
+            if (listen_fd >= 0) {
+                fds.push_back(pollfd{listen_fd, POLLIN, 0});
+                fd_worker.push_back(-1);
+            }
+            size_t first_greeting = fds.size();
+            for (const auto& g : greetings)
+                fds.push_back(pollfd{g.fd, POLLIN, 0});
+
+            if (::poll(fds.data(), nfds_t(fds.size()), poll_timeout_ms(deadline)) < 0)
+                continue;
+
+            std::vector<pollfd> greeting_fds(fds.begin() + first_greeting, fds.end());
+            fds.resize(first_greeting);
+            read_greetings(greeting_fds);
+
+            for (size_t k = 0; k < fds.size(); k++) {
+                if (fds[k].revents == 0)
+                    continue;
+                if (fd_worker[k] < 0) {
+                    accept_workers();
+                    continue;
+                }
+
+                int w = fd_worker[k];
+                worker_state& worker = workers[w];
+                farm_result result;
+                int t = -1;
+                bool ok = recv_all(worker.fd, &result, sizeof(result));
+                if (ok) {
+                    for (size_t slot = 0; slot < worker.tiles.size(); slot++)
+                        if (tiles[worker.tiles[slot]].index == result.tile_index)
+                            t = worker.tiles[slot];
+                    ok = t >= 0 && result.pixels == (tiles[t].x1 - tiles[t].x0) * (tiles[t].y1 - tiles[t].y0);
+                }
+                if (ok) {
+                    pixel_data.resize(size_t(result.pixels) * 3);
+                    ok = recv_all(worker.fd, pixel_data.data(), pixel_data.size() * sizeof(double));
+                }
+                if (!ok) {
+                    lose_worker(w, pending);
+                    continue;
+                }
+
+                const tile& done = tiles[t];
+                size_t n = 0;
+                for (int j = done.y0; j < done.y1; j++)
+                    for (int i = done.x0; i < done.x1; i++, n += 3)
+                        image.at(i, j) = color(pixel_data[n], pixel_data[n+1], pixel_data[n+2]);
+
+                for (size_t slot = 0; slot < worker.tiles.size(); slot++) {
+                    if (worker.tiles[slot] == t) {
+                        slowest_tile = std::max(slowest_tile, seconds_since(worker.sent[slot]));
+                        worker.tiles.erase(worker.tiles.begin() + slot);
+                        worker.sent.erase(worker.sent.begin() + slot);
+                        break;
+                    }
+                }
+                report_progress(--remaining);
+            }
+
+            // Drop workers that have gone silent, handing their tiles out again, and allow the next ones longer.
+            for (int w = 0; w < int(workers.size()) && tile_timeout > 0; w++) {
+                for (const auto& sent : workers[w].sent) {
+                    if (clock::now() > sent + tile_time_limit()) {
+                        std::clog << "\nA render worker has not returned a tile in " << tile_timeout << " s";
+                        lose_worker(w, pending);
+                        tile_timeout *= 2;
+                        break;
+                    }
+                }
+            }
+        }
+#else
+        (void)sample0;
+        (void)sample1;
+        (void)scale;
+        (void)image;
+        for (const auto& t : tiles)
+            render_locally(t);
+#endif
+    }
+
+
+    // Connects to a coordinator's TCP port, as "host:port". Returns the connection, or -1 if it cannot be made.
+    static int connect_to(const std::string& address) {
+#ifndef _WIN32
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos)
+            return -1;
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (::getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &found) != 0)
+            return -1;
+
+        int fd = -1;
+        for (addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+            fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(found);
+
+        if (fd >= 0) {
+            int yes = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+        return fd;
+#else
+        (void)address;
+        return -1;
+#endif
+    }
+
+
+    // The worker's side of a connection: says hello, then renders the tiles it is sent until it is asked to exit or the
+    // connection drops. Up to threads tiles are rendered at a time, each by render_tile(tile, sample0, sample1, scale,
+    // image), which stores the tile's pixels in image (a full-size framebuffer the worker keeps for the purpose).
+    // Returns false if the connection dropped.
+    static bool serve(int fd, uint64_t key, int threads, int width, int height,
+                      const std::function<void(const tile&, int, int, double, framebuffer&)>& render_tile) {
+#ifndef _WIN32
+        threads = threads < 1 ? 1 : threads;
+
+        farm_hello hello = make_hello(key, threads);
+        if (!send_all(fd, &hello, sizeof(hello)))
+            return false;
+
+        framebuffer image(width, height);
+        std::mutex lock;                    // Guards jobs, stopping and writes to fd
+        std::condition_variable job_ready;
+        std::deque<farm_job> jobs;
+        bool stopping = false;
+        bool connected = true;
+
+        auto render_jobs = [&]() {
+            std::vector<double> pixel_data;
+            while (true) {
+                farm_job job;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    job_ready.wait(guard, [&]() { return stopping || !jobs.empty(); });
+                    if (jobs.empty())
+                        return;
+                    job = jobs.front();
+                    jobs.pop_front();
+                }
+
+                tile t = { job.tile_index, job.x0, job.y0, job.x1, job.y1 };
+                render_tile(t, job.sample0, job.sample1, job.scale, image);
+
+                farm_result result = { job.tile_index, (t.x1 - t.x0) * (t.y1 - t.y0) };
+                pixel_data.clear();
+                for (int j = t.y0; j < t.y1; j++) {
+                    for (int i = t.x0; i < t.x1; i++) {
+                        const color& c = image.at(i, j);
+                        pixel_data.push_back(c.x());
+                        pixel_data.push_back(c.y());
+                        pixel_data.push_back(c.z());
+                    }
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                if (connected)
+                    connected = send_all(fd, &result, sizeof(result))
+                             && send_all(fd, pixel_data.data(), pixel_data.size() * sizeof(double));
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (int k = 0; k < threads; k++)
+            pool.emplace_back(render_jobs);
+
+        // Read jobs until asked to exit (or the coordinator goes away).
+        bool asked_to_exit = false;
+        farm_job job;
+        while (recv_all(fd, &job, sizeof(job))) {
+            if (job.tile_index < 0) {
+                asked_to_exit = true;
+                break;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(job);
+            job_ready.notify_one();
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            if (!asked_to_exit)
+                jobs.clear();
+        }
+        job_ready.notify_all();
+        for (auto& thread : pool)
+            thread.join();
+
+        ::close(fd);
+        return asked_to_exit;
+#else
+        (void)fd; (void)key; (void)threads; (void)width; (void)height; (void)render_tile;
+        return false;
+#endif
+    }
+
+
+  private:
+
+    // A connected worker and the tiles (indices into the tile list of the current run) it is rendering.
+    struct worker_state {
+        int fd;
+        int pid;                // Of a local worker process (0 for a remote worker)
+        int threads;
+        std::vector<int> tiles;
+        std::vector<std::chrono::steady_clock::time_point> sent;   // When each of the tiles was handed out
+    };
+
+    // A new connection that has not yet said hello, and the part of its hello received so far.
+    struct greeting {
+        int fd;
+        int pid;
+        std::vector<char> received;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    using clock = std::chrono::steady_clock;
+
+    uint64_t key;
+    std::vector<worker_state> workers;
+    std::vector<greeting> greetings;
+    int listen_fd = -1;
+    double slowest_tile = 0;        // Longest a worker has taken to return a tile, in seconds
+
+
+    static farm_hello make_hello(uint64_t key, int threads) {
+        farm_hello hello;
+        std::memset(&hello, 0, sizeof(hello));
+        std::memcpy(hello.magic, "RTWFARM1", sizeof(hello.magic));
+        hello.version = protocol_version;
+        hello.threads = threads;
+        hello.key = key;
+        return hello;
+    }
+
+#ifndef _WIN32
+    // Starts waiting for a new connection's hello (see read_greetings()). The connection is non-blocking until then.
+    void begin_greeting(int fd, int pid) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        greetings.push_back(greeting{fd, pid, std::vector<char>(), clock::now() + to_duration(hello_timeout)});
+    }
+
+    // Reads what has arrived of the hellos of the connections in fds (as polled, in the order of greetings). A
+    // connection whose hello is complete is taken on as a worker if it renders the same scene with the same settings,
+    // and turned away otherwise; one that closes, or has not said hello by its deadline, is turned away.
+    void read_greetings(const std::vector<pollfd>& fds) {
+        std::vector<greeting> waiting;
+        for (size_t g = 0; g < greetings.size(); g++) {
+            greeting& conn = greetings[g];
+            bool failed = false;
+
+            if (g < fds.size() && fds[g].revents != 0) {
+                char buffer[sizeof(farm_hello)];
+                ssize_t n = ::recv(conn.fd, buffer, sizeof(farm_hello) - conn.received.size(), 0);
+                if (n > 0)
+                    conn.received.insert(conn.received.end(), buffer, buffer + n);
+                else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    failed = true;
+            }
+
+            if (!failed && conn.received.size() == sizeof(farm_hello)) {
+                farm_hello hello;
+                std::memcpy(&hello, conn.received.data(), sizeof(hello));
+                add_worker(conn.fd, conn.pid, hello);
+            } else if (failed || clock::now() > conn.deadline) {
+                std::cerr << "\nTurned away a render worker that did not say hello\n";
+                turn_away(conn.fd, conn.pid);
+            } else {
+                waiting.push_back(conn);
+            }
+        }
+        greetings.swap(waiting);
+    }
+
+    // Takes on a connection that has said hello, if the hello shows it renders the same scene with the same settings.
+    void add_worker(int fd, int pid, const farm_hello& hello) {
+        farm_hello expected = make_hello(key, 0);
+        if (std::memcmp(hello.magic, expected.magic, sizeof(hello.magic)) != 0 || hello.version != expected.version
+            || hello.key != key || hello.threads < 1) {
+            std::cerr << "\nTurned away a render worker with a different scene, settings or build\n";
+            turn_away(fd, pid);
+            return;
+        }
+
+        // From now on messages are read whole, once poll() shows they have started to arrive; the timeouts stop a
+        // worker that stalls part way through one from holding up the coordinator.
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        timeval timeout;
+        timeout.tv_sec = long(io_timeout);
+        timeout.tv_usec = long((io_timeout - double(timeout.tv_sec)) * 1e6);
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        workers.push_back(worker_state{fd, pid, hello.threads, std::vector<int>(), std::vector<clock::time_point>()});
+    }
+
+    static void turn_away(int fd, int pid) {
+        ::close(fd);
+        if (pid > 0) {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }
+    }
+
+    // Accepts any workers waiting to connect, without waiting. Their hellos are read as they arrive.
+    void accept_workers() {
+        if (listen_fd < 0)
+            return;
+        pollfd p = { listen_fd, POLLIN, 0 };
+        while (::poll(&p, 1, 0) > 0 && (p.revents & POLLIN)) {
+            int fd = ::accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                break;
+            int yes = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            begin_greeting(fd, 0);
+        }
+    }
+
+    // Longest a worker may take to return a tile.
+    clock::duration tile_time_limit() const {
+        return to_duration(std::max(tile_timeout, 8 * slowest_tile));
+    }
+
+    // Milliseconds for poll() to wait: until deadline or the earliest greeting deadline, whichever is sooner.
+    int poll_timeout_ms(clock::time_point deadline) const {
+        for (const auto& g : greetings)
+            deadline = std::min(deadline, g.deadline);
+        if (deadline == clock::time_point::max())
+            return -1;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count() + 1;
+        return int(std::max<long long>(0, std::min<long long>(ms, 60000)));
+    }
+
+    static clock::duration to_duration(double seconds) {
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    static double seconds_since(clock::time_point t) {
+        return std::chrono::duration<double>(clock::now() - t).count();
+    }
+
+    // Drops a worker whose connection failed, handing its tiles out again (first, as they were handed out earliest).
+    void lose_worker(int w, std::deque<int>& pending) {
+        worker_state& worker = workers[w];
+        std::clog << "\nLost a render worker; reissuing " << worker.tiles.size() << " tile(s)\n";
+        for (auto t = worker.tiles.rbegin(); t != worker.tiles.rend(); ++t)
+            pending.push_front(*t);
+        worker.tiles.clear();
+        worker.sent.clear();
+        ::close(worker.fd);
+        worker.fd = -1;
+        if (worker.pid > 0) {
+            ::kill(worker.pid, SIGKILL);        // In case it is still running, but no longer answering
+            ::waitpid(worker.pid, nullptr, 0);
+            worker.pid = 0;
+        }
+    }
+
+    static bool send_all(int fd, const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);       // A dropped connection fails rather than raising SIGPIPE
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= size_t(sent);
+        }
+        return true;
+    }
+
+    static bool recv_all(int fd, void* data, size_t size) {
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t received = ::recv(fd, bytes, size, 0);
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= size_t(received);
+        }
+        return true;
+    }
+#endif
+
+    static void report_progress(int remaining) {
+        std::clog << "\rTiles remaining: " << remaining << ' ' << std::flush;
+    }
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// Optional instrumentation of the renderer: counts of the rays traced, BVH nodes visited, box and primitive tests and
+// path lengths, the time taken by each tile and by each phase of the run, and the traversal cost of each pixel (which
+// the camera can write out as a heatmap). It is only compiled in when RTW_STATS is defined (the CMake option of the
+// same name). Otherwise RTW_STAT() expands to nothing and the render_stats hooks return at once, so the hot paths are
+// exactly what they are without it.
+//
+// Every thread counts into its own thread_local ray_counters, so counting needs no locks or atomics. The camera merges
+// a thread's counters into the totals after each tile (see tile_scope).
+
+#ifdef RTW_STATS
+#define RTW_STAT(counter, n)    (render_stats::local().counter += uint64_t(n))
+#define RTW_STAT_PATH(length)   (render_stats::local().add_path(length))
+#else
+#define RTW_STAT(counter, n)    ((void)0)
+#define RTW_STAT_PATH(length)   ((void)0)
+#endif
+
+
+// Event counts of one thread, or the totals of all threads.
+struct ray_counters {
+    static const int path_length_bins = 16;
+
+    uint64_t rays            = 0;   // Rays intersected with the world (camera rays and scattered rays)
+    uint64_t node_visits     = 0;   // BVH nodes visited
+    uint64_t box_tests       = 0;   // Ray-box tests
+    uint64_t primitive_tests = 0;   // Ray-primitive tests
+    uint64_t path_lengths[path_length_bins] = {};   // Number of paths of k rays (the last bin also counts longer paths)
+
+    // Records the end of a path that traced length rays.
+    void add_path(int length) {
+        path_lengths[std::min(std::max(length, 0), path_length_bins - 1)]++;
+    }
+
+    uint64_t paths() const {
+        uint64_t n = 0;
+        for (auto count : path_lengths)
+            n += count;
+        return n;
+    }
+
+    // Work done traversing the scene, as drawn in the heatmap.
+    uint64_t traversal_cost() const { return node_visits + primitive_tests; }
+
+    void merge(const ray_counters& other) {
+        rays            += other.rays;
+        node_visits     += other.node_visits;
+        box_tests       += other.box_tests;
+        primitive_tests += other.primitive_tests;
+        for (int k = 0; k < path_length_bins; k++)
+            path_lengths[k] += other.path_lengths[k];
+    }
+};
+
+
+class render_stats {
+
+  public:
+
+#ifdef RTW_STATS
+    static const bool enabled = true;
+#else
+    static const bool enabled = false;
+#endif
+
+    // The calling thread's counters.
+    static ray_counters& local() {
+        thread_local ray_counters counters;
+        return counters;
+    }
+
+
+    // Clears the counters, tile times and pixel costs ahead of rendering a width x height image. Phase times are kept,
+    // as phases such as building the BVH come before the render.
+    static void begin_render(int width, int height) {
+        if (!enabled)
+            return;
+        shared_data& data = shared();
+        std::lock_guard<std::mutex> guard(data.lock);
+        data.totals = ray_counters();
+        data.tiles.clear();
+        data.pixel_costs.assign(size_t(width) * height, 0);
+        data.pixel_samples.assign(size_t(width) * height, 0);
+        local() = ray_counters();
+    }
+
+
+    // Times one tile; when it goes out of scope the tile's time is recorded and the thread's counters are merged into
+    // the totals.
+    class tile_scope {
+      public:
+        tile_scope(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {
+            if (enabled)
+                start = std::chrono::steady_clock::now();
+        }
+
+        ~tile_scope() {
+            if (!enabled)
+                return;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            shared_data& data = shared();
+            std::lock_guard<std::mutex> guard(data.lock);
+            data.totals.merge(local());
+            data.tiles.push_back(tile_time{x0, y0, x1, y1, seconds});
+            local() = ray_counters();
+        }
+
+      private:
+        int x0, y0, x1, y1;
+        std::chrono::steady_clock::time_point start;
+    };
+
+
+    // Times one phase of the run (building the BVH, rendering, writing the image...) until it goes out of scope.
+    class phase_scope {
+      public:
+        explicit phase_scope(const char* name) : name(name) {
+            if (enabled)
+                start = std::chrono::steady_clock::now();
+        }
+
+        ~phase_scope() {
+            if (!enabled)
+                return;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            shared_data& data = shared();
+            std::lock_guard<std::mutex> guard(data.lock);
+            data.phases.push_back(phase_time{name, seconds});
+        }
+
+      private:
+        const char* name;
+        std::chrono::steady_clock::time_point start;
+    };
+
+
+    // Number of rays in a packet's active mask, for counting the rays of a packet test.
+    static int count_lanes(unsigned int mask) {
+        int lanes = 0;
+        for (; mask != 0; mask &= mask - 1)
+            lanes++;
+        return lanes;
+    }
+
+
+    // Pixel costs: take a mark() before tracing a pixel's rays, then add_pixel_cost() the work done since (or a 1/share
+    // part of it, for work shared by several pixels). A pixel is only ever traced by one thread at a time (it belongs to
+    // one tile), so the per-pixel totals need no locking.
+    static uint64_t mark() {
+        return enabled ? local().traversal_cost() : 0;
+    }
+
+    static void add_pixel_cost(size_t pixel, uint64_t since_mark, int share = 1) {
+        if (enabled)
+            shared().pixel_costs[pixel] += (local().traversal_cost() - since_mark) / uint64_t(share);
+    }
+
+    static void add_pixel_samples(size_t pixel, int samples) {
+        if (enabled)
+            shared().pixel_samples[pixel] += uint32_t(samples);
+    }
+
+    // Mean traversal cost of a sample in each pixel of the last render (scanline order).
+    static std::vector<double> cost_per_sample() {
+        const shared_data& data = shared();
+        std::vector<double> costs(data.pixel_costs.size(), 0.0);
+        for (size_t p = 0; p < costs.size(); p++)
+            if (data.pixel_samples[p] > 0)
+                costs[p] = double(data.pixel_costs[p]) / data.pixel_samples[p];
+        return costs;
+    }
+
+
+    // Prints a summary of the last render.
+    static void report(std::ostream& out) {
+
+        const shared_data& data = shared();
+        const ray_counters& c = data.totals;
+        const double rays = double(std::max<uint64_t>(c.rays, 1));
+
+        double render_seconds = 0;
+        for (const auto& phase : data.phases)
+            if (std::string(phase.name) == "render")
+                render_seconds = phase.seconds;
+
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(2);
+
+        out << "Ray statistics\n";
+        out << "  Rays:             " << c.rays;
+        if (render_seconds > 0)
+            out << " (" << c.rays / render_seconds / 1e6 << " Mrays/s)";
+        out << '\n';
+
+        uint64_t paths = c.paths();
+        out << "  Paths:            " << paths << " (mean length " << (paths > 0 ? c.rays / double(paths) : 0.0) << " rays)\n";
+        out << "  Nodes visited:    " << c.node_visits / rays << " per ray\n";
+        out << "  Box tests:        " << c.box_tests / rays << " per ray\n";
+        out << "  Primitive tests:  " << c.primitive_tests / rays << " per ray\n";
+
+        out << "  Path lengths:    ";
+        for (int k = 1; k < ray_counters::path_length_bins; k++) {
+            if (c.path_lengths[k] == 0)
+                continue;
+            out << ' ' << k << (k == ray_counters::path_length_bins - 1 ? "+" : "") << ": "
+                << 100.0 * c.path_lengths[k] / double(std::max<uint64_t>(paths, 1)) << '%';
+        }
+        out << '\n';
+
+        if (!data.tiles.empty()) {
+            double total = 0;
+            const tile_time* slowest = &data.tiles[0];
+            const tile_time* fastest = &data.tiles[0];
+            for (const auto& t : data.tiles) {
+                total += t.seconds;
+                if (t.seconds > slowest->seconds) slowest = &t;
+                if (t.seconds < fastest->seconds) fastest = &t;
+            }
+            out << "  Tiles:            " << data.tiles.size() << ", " << 1e3 * fastest->seconds << " to "
+                << 1e3 * slowest->seconds << " ms (mean " << 1e3 * total / data.tiles.size() << " ms); slowest ("
+                << slowest->x0 << "," << slowest->y0 << ")-(" << slowest->x1 << "," << slowest->y1 << ")\n";
+        }
+
+        if (!data.phases.empty()) {
+            out << "  Phases:          ";
+            for (const auto& phase : data.phases)
+                out << ' ' << phase.name << ' ' << 1e3 * phase.seconds << " ms" << (&phase != &data.phases.back() ? "," : "");
+            out << '\n';
+        }
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+
+  private:
+
+    struct tile_time {
+        int x0, y0, x1, y1;
+        double seconds;
+    };
+
+    struct phase_time {
+        const char* name;
+        double seconds;
+    };
+
+    struct shared_data {
+        std::mutex lock;                    // Guards totals, tiles and phases
+        ray_counters totals;                // Counts of the tiles finished so far
+        std::vector<tile_time> tiles;
+        std::vector<phase_time> phases;
+        std::vector<uint64_t> pixel_costs;  // Traversal cost of each pixel's samples
+        std::vector<uint32_t> pixel_samples;
+    };
+
+    static shared_data& shared() {
+        static shared_data data;
+        return data;
+    }
+};
@@ -1,11 +1,23 @@
 #pragma once
 
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <memory>
-#include <random>
 
+#include "sampler.h"
+
+
+// Scalar type of the geometry and colour types (vec3, point3, color, ray, interval, aabb). Double precision by default;
+// building with RTW_USE_FLOAT (the CMake option of the same name) makes it single precision, which halves the size of
+// every primitive and doubles the number of SIMD lanes.
+
+#ifdef RTW_USE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
 
 // C++ Std Usings
 
@@ -17,16 +29,28 @@ using std::shared_ptr;
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
+// Tolerances for rounding errors, which depend on the precision of real.
+// ray_t_min: hits closer than this along a ray are ignored. Stops the "shadow acne" caused by round off errors putting the
+// origin of a scattered ray just below the surface it left (section 9.3).
+// aabb_padding: thinnest a bounding box can be, so that rays still enter the boxes of flat objects.
+// Single precision needs both ten times larger: with 0.001, float renders of the main.cc scene show visible acne.
+#ifdef RTW_USE_FLOAT
+const double ray_t_min = 0.01;
+const double aabb_padding = 0.001;
+#else
+const double ray_t_min = 0.001;
+const double aabb_padding = 0.0001;
+#endif
+
 // Utility Functions
 
 inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Returns a random real in [0,1) from the calling thread's sampler (see sampler.h).
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return sampler::generator().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "color.h"
+
+#include <algorithm>
+
+
+// Russian roulette path termination. Once a path has scattered start_depth times, each further bounce survives with
+// probability p (the path's largest throughput component, but at least min_survival) and a surviving path's
+// throughput is divided by p. Paths that have become too dark to matter are mostly ended early, while the expected
+// value of every path is unchanged, so the image stays unbiased (only its noise changes).
+struct russian_roulette {
+
+    int    start_depth  = 3;        // Number of bounces before paths can be terminated
+    double min_survival = 0.05;     // Lowest probability of a path surviving a bounce
+
+    // Decides whether a path that has made bounces scattering events continues, and if so rescales its throughput.
+    // Draws one random number from the current sequence (see sampler.h) when the roulette applies.
+    bool survives(int bounces, color& throughput) const {
+
+        if (bounces < start_depth)
+            return true;
+
+        double p = std::max(throughput.x(), std::max(throughput.y(), throughput.z()));
+        p = std::min(1.0, std::max(min_survival, p));
+
+        if (random_double() >= p)
+            return false;
+
+        throughput = throughput / p;
+        return true;
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+
+// PCG32 random number generator (M.E. O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good
+// Algorithms for Random Number Generation", pcg-random.org). 16 bytes of state, one multiply-add per number.
+class pcg32 {
+
+  public:
+
+    pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+    pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+    // initstate picks the starting point in the sequence, initseq picks one of 2^63 independent sequences (streams).
+    void seed(uint64_t initstate, uint64_t initseq) {
+        state = 0;
+        inc = (initseq << 1u) | 1u;     // Increment must be odd
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+
+    // Returns a uniformly distributed 32-bit unsigned integer.
+    uint32_t next_uint() {
+        uint64_t oldstate = state;
+        state = oldstate * 6364136223846793005ULL + inc;                            // Advance the internal LCG state
+        uint32_t xorshifted = uint32_t(((oldstate >> 18u) ^ oldstate) >> 27u);      // Permute the old state into the output (XSH RR)
+        uint32_t rot = uint32_t(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // Returns a uniformly distributed real in [0,1).
+    double next_double() {
+        return next_uint() * (1.0 / 4294967296.0);
+    }
+
+    uint64_t get_state() const { return state; }
+    uint64_t get_inc() const { return inc; }
+
+  private:
+    uint64_t state;     // LCG state. All values are possible.
+    uint64_t inc;       // Controls which stream (sequence) is used. Always odd.
+};
+
+
+// SplitMix64 finaliser (Steele, Lea & Flood 2014): scrambles all input bits into all output bits.
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// A running hash, for the keys that tell whether two scenes, renders or BVHs are the same: start from hash_seed and
+// add each 64-bit word of input (or the bits of each double) in turn.
+const uint64_t hash_seed = 0x9e3779b97f4a7c15ULL;
+
+inline void hash_combine(uint64_t& h, uint64_t word) {
+    h = mix64(h ^ word);
+}
+
+inline void hash_double(uint64_t& h, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    hash_combine(h, bits);
+}
+
+
+// The sampler decides which random numbers each part of the render receives.
+// Rather than drawing from one long sequence (whose position depends on the order in which pixels happen to be
+// rendered), every (pixel, sample, bounce) triple hashes to its own PCG32 starting point. A render therefore produces
+// the same image regardless of thread count, tile order or machine.
+//
+// Each thread has its own current generator; random_double() (see rtweekend.h) draws from it.
+class sampler {
+
+  public:
+
+    // Starts the random sequence for camera sample number sample_index of pixel pixel_index.
+    // The camera ray itself (pixel jitter, defocus disk, time) is generated from bounce 0.
+    static void begin_sample(uint64_t pixel_index, uint32_t sample_index) {
+        context& c = current();
+        c.pixel = pixel_index;
+        c.sample = sample_index;
+        c.rng.seed(hash(c.pixel, c.sample, 0), stream);
+    }
+
+    // Switches to the random sequence of the given bounce of the current pixel sample.
+    static void begin_bounce(uint32_t bounce) {
+        context& c = current();
+        c.rng.seed(hash(c.pixel, c.sample, bounce), stream);
+    }
+
+    // The calling thread's generator.
+    static pcg32& generator() { return current().rng; }
+
+
+  private:
+
+    static const uint64_t stream = 0xda3e39cb94b95bdbULL;     // All samples share one stream, and differ by starting state.
+
+    struct context {
+        uint64_t pixel = 0;
+        uint32_t sample = 0;
+        pcg32 rng;
+    };
+
+    static context& current() {
+        thread_local context c;
+        return c;
+    }
+
+    static uint64_t hash(uint64_t pixel, uint32_t sample, uint32_t bounce) {
+        return mix64(mix64(mix64(pixel) ^ sample) ^ bounce);
+    }
+};
@@ -0,0 +1,686 @@
+#pragma once
+
+#include "camera.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere_set.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Scene files describe the camera, materials and spheres (stationary or moving) of a scene, so that scenes can be
+// changed without recompiling. There are two forms, which scene_file::read() tells apart by their first bytes.
+//
+// Text, for writing by hand. One item per line, and # starts a comment:
+//
+//     camera <setting> <value(s)>              (see camera_setting_size() for the settings)
+//     material <name> lambertian <r> <g> <b>
+//     material <name> metal <r> <g> <b> <fuzz>
+//     material <name> dielectric <refraction index>
+//     sphere <x> <y> <z> <radius> <material name>
+//     moving_sphere <x1> <y1> <z1> <x2> <y2> <z2> <radius> <material name>     (centre at time=0, then at time=1)
+//
+// Binary, for large generated scenes: a header, the camera settings and materials, then each sphere attribute as one
+// array of 32-bit floats (native byte order). Loading it is a handful of large sequential reads.
+//
+// Spheres are loaded structure-of-arrays into a scene_description, which is how a sphere_set stores them, and the
+// arrays are then handed over to the sphere_set without being copied. Only the materials are allocated one by one.
+
+
+// A material, as described in a scene file.
+struct material_description {
+    material_type type = material_type::lambertian;
+    color  albedo = color(0.5, 0.5, 0.5);   // Lambertian and metal
+    double fuzz = 0;                        // Metal
+    double refraction_index = 1.5;          // Dielectric
+
+    static material_description lambertian_material(const color& albedo) {
+        material_description m;
+        m.albedo = albedo;
+        return m;
+    }
+
+    static material_description metal_material(const color& albedo, double fuzz) {
+        material_description m;
+        m.type = material_type::metal;
+        m.albedo = albedo;
+        m.fuzz = fuzz;
+        return m;
+    }
+
+    static material_description dielectric_material(double refraction_index) {
+        material_description m;
+        m.type = material_type::dielectric;
+        m.refraction_index = refraction_index;
+        return m;
+    }
+
+    shared_ptr<material> make() const {
+        if (type == material_type::metal)
+            return make_shared<metal>(albedo, fuzz);
+        if (type == material_type::dielectric)
+            return make_shared<dielectric>(refraction_index);
+        return make_shared<lambertian>(albedo);
+    }
+};
+
+
+// A camera setting: the name of a public camera member and its value (one number, or three for a point or vector).
+struct camera_setting {
+    std::string name;
+    double values[3];
+    int count;
+};
+
+// Number of values taken by the camera setting of the given name, or 0 if there is no such setting.
+inline int camera_setting_size(const std::string& name) {
+    if (name == "lookfrom" || name == "lookat" || name == "vup")
+        return 3;
+    if (name == "aspect_ratio" || name == "image_width" || name == "samples_per_pixel" || name == "max_depth" ||
+        name == "vfov" || name == "defocus_angle" || name == "focus_dist")
+        return 1;
+    return 0;
+}
+
+
+// The contents of a scene file.
+class scene_description {
+
+  public:
+
+    std::vector<camera_setting> camera_settings;
+    std::vector<std::string> material_names;
+    std::vector<material_description> materials;
+
+    // The spheres, structure-of-arrays as in sphere_set: centres at time=0 and motions (by axis), radii, and indices
+    // into materials.
+    std::vector<real> center[3];
+    std::vector<real> motion[3];
+    std::vector<real> radius;
+    std::vector<uint32_t> material_id;
+
+
+    size_t sphere_count() const { return radius.size(); }
+
+    void set_camera(const std::string& name, double value) {
+        camera_settings.push_back(camera_setting{name, {value, 0, 0}, 1});
+    }
+
+    void set_camera(const std::string& name, const vec3& value) {
+        camera_settings.push_back(camera_setting{name, {value.x(), value.y(), value.z()}, 3});
+    }
+
+    // Adds a material and returns its index. An empty name is replaced by "material<index>".
+    uint32_t add_material(const material_description& m, const std::string& name = std::string()) {
+        uint32_t id = uint32_t(materials.size());
+        materials.push_back(m);
+        material_names.push_back(name.empty() ? "material" + std::to_string(id) : name);
+        return id;
+    }
+
+    // Adds a sphere with its centre at center1 at time=0 and at center2 at time=1 (the same for a stationary sphere).
+    void add_sphere(const point3& center1, const point3& center2, double sphere_radius, uint32_t mat) {
+        for (int axis = 0; axis < 3; axis++) {
+            center[axis].push_back(center1[axis]);
+            motion[axis].push_back(center2[axis] - center1[axis]);
+        }
+        radius.push_back(std::fmax(0, sphere_radius));
+        material_id.push_back(mat);
+    }
+
+    bool has_motion() const {
+        for (int axis = 0; axis < 3; axis++)
+            for (auto m : motion[axis])
+                if (m != 0)
+                    return true;
+        return false;
+    }
+
+
+    // Hash of the materials and spheres (not the camera settings), so that processes can check they have loaded the
+    // same scene (see camera::scene_key). Must be taken before move_into().
+    uint64_t content_key() const {
+
+        uint64_t h = hash_seed;
+        hash_combine(h, uint64_t(materials.size()));
+        for (const auto& m : materials) {
+            hash_combine(h, uint64_t(m.type));
+            for (int k = 0; k < 3; k++)
+                hash_double(h, m.albedo[k]);
+            hash_double(h, m.fuzz);
+            hash_double(h, m.refraction_index);
+        }
+
+        hash_combine(h, uint64_t(sphere_count()));
+        for (size_t k = 0; k < sphere_count(); k++) {
+            for (int axis = 0; axis < 3; axis++) {
+                hash_double(h, center[axis][k]);
+                hash_double(h, motion[axis][k]);
+            }
+            hash_double(h, radius[k]);
+            hash_combine(h, material_id[k]);
+        }
+        return h;
+    }
+
+
+    // Sets the camera members named by the camera settings.
+    void apply(camera& cam) const {
+        for (const auto& s : camera_settings) {
+            const double* v = s.values;
+            if      (s.name == "aspect_ratio")      cam.aspect_ratio = v[0];
+            else if (s.name == "image_width")       cam.image_width = int(v[0]);
+            else if (s.name == "samples_per_pixel") cam.samples_per_pixel = int(v[0]);
+            else if (s.name == "max_depth")         cam.max_depth = int(v[0]);
+            else if (s.name == "vfov")              cam.vfov = v[0];
+            else if (s.name == "lookfrom")          cam.lookfrom = point3(v[0], v[1], v[2]);
+            else if (s.name == "lookat")            cam.lookat = point3(v[0], v[1], v[2]);
+            else if (s.name == "vup")               cam.vup = vec3(v[0], v[1], v[2]);
+            else if (s.name == "defocus_angle")     cam.defocus_angle = v[0];
+            else if (s.name == "focus_dist")        cam.focus_dist = v[0];
+        }
+    }
+
+    // Moves the spheres into set, with one material object for each material. The description is left without spheres.
+    void move_into(sphere_set& set) {
+        std::vector<uint32_t> set_ids(materials.size());
+        for (size_t k = 0; k < materials.size(); k++)
+            set_ids[k] = set.add_material(materials[k].make());
+
+        // The set numbers the materials in the same order if it had none before; otherwise the ids are translated.
+        for (size_t k = 0; k < set_ids.size(); k++) {
+            if (set_ids[k] != k) {
+                for (auto& id : material_id)
+                    id = set_ids[id];
+                break;
+            }
+        }
+
+        set.add_spheres(center, motion, radius, material_id);
+    }
+};
+
+
+// Reads and writes scene files (see the top of this file for the formats).
+class scene_file {
+
+  public:
+
+    // Reads the scene file at path, in either form, adding its contents to scene. Returns false, with a message in
+    // error, if the file cannot be read or is not a valid scene file.
+    static bool read(const std::string& path, scene_description& scene, std::string& error) {
+
+        FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            error = "cannot open file";
+            return false;
+        }
+
+        char magic[binary_magic_size] = {};
+        size_t n = std::fread(magic, 1, sizeof(magic), file);
+        bool binary = n == sizeof(magic) && std::memcmp(magic, binary_magic(), sizeof(magic)) == 0;
+        std::rewind(file);
+
+        bool ok = binary ? read_binary(file, scene, error) : read_text(file, scene, error);
+        std::fclose(file);
+        return ok;
+    }
+
+    // Writes scene to path as text. Returns false if the file could not be written.
+    static bool write_text(const std::string& path, const scene_description& scene) {
+
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+
+        char a[32], b[32], c[32], d[32];
+
+        for (const auto& s : scene.camera_settings) {
+            std::fprintf(file, "camera %s", s.name.c_str());
+            for (int k = 0; k < s.count; k++)
+                std::fprintf(file, " %s", format_number(s.values[k], a));
+            std::fputc('\n', file);
+        }
+
+        for (size_t k = 0; k < scene.materials.size(); k++) {
+            const material_description& m = scene.materials[k];
+            const char* name = scene.material_names[k].c_str();
+            if (m.type == material_type::metal)
+                std::fprintf(file, "material %s metal %s %s %s %s\n", name, format_number(m.albedo.x(), a),
+                             format_number(m.albedo.y(), b), format_number(m.albedo.z(), c), format_number(m.fuzz, d));
+            else if (m.type == material_type::dielectric)
+                std::fprintf(file, "material %s dielectric %s\n", name, format_number(m.refraction_index, a));
+            else
+                std::fprintf(file, "material %s lambertian %s %s %s\n", name, format_number(m.albedo.x(), a),
+                             format_number(m.albedo.y(), b), format_number(m.albedo.z(), c));
+        }
+
+        char x[3][32], m[3][32];
+        for (size_t k = 0; k < scene.sphere_count(); k++) {
+            const char* name = scene.material_names[scene.material_id[k]].c_str();
+            for (int axis = 0; axis < 3; axis++)
+                format_number(scene.center[axis][k], x[axis]);
+
+            if (scene.motion[0][k] == 0 && scene.motion[1][k] == 0 && scene.motion[2][k] == 0) {
+                std::fprintf(file, "sphere %s %s %s %s %s\n", x[0], x[1], x[2], format_number(scene.radius[k], a), name);
+            } else {
+                for (int axis = 0; axis < 3; axis++)
+                    format_number(scene.center[axis][k] + scene.motion[axis][k], m[axis]);
+                std::fprintf(file, "moving_sphere %s %s %s %s %s %s %s %s\n", x[0], x[1], x[2], m[0], m[1], m[2],
+                             format_number(scene.radius[k], a), name);
+            }
+        }
+
+        return std::fclose(file) == 0;
+    }
+
+    // Writes scene to path in binary. Sphere attributes are stored in single precision, so a double precision scene
+    // is rounded. Returns false if the file could not be written.
+    static bool write_binary(const std::string& path, const scene_description& scene) {
+
+        FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+
+        binary_header header;
+        std::memcpy(header.magic, binary_magic(), sizeof(header.magic));
+        header.version = 1;
+        header.flags = scene.has_motion() ? has_motion_flag : 0;
+        header.camera_settings = uint32_t(scene.camera_settings.size());
+        header.materials = uint32_t(scene.materials.size());
+        header.spheres = uint64_t(scene.sphere_count());
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+        for (const auto& s : scene.camera_settings) {
+            ok = ok && write_string(file, s.name)
+                    && write_value(file, uint32_t(s.count))
+                    && std::fwrite(s.values, sizeof(double), size_t(s.count), file) == size_t(s.count);
+        }
+
+        for (size_t k = 0; k < scene.materials.size(); k++) {
+            const material_description& m = scene.materials[k];
+            float params[4] = { float(m.albedo.x()), float(m.albedo.y()), float(m.albedo.z()), float(m.fuzz) };
+            if (m.type == material_type::dielectric)
+                params[0] = float(m.refraction_index);
+            ok = ok && write_string(file, scene.material_names[k])
+                    && write_value(file, uint32_t(m.type))
+                    && std::fwrite(params, sizeof(float), 4, file) == 4;
+        }
+
+        for (int axis = 0; axis < 3; axis++)
+            ok = ok && write_array(file, scene.center[axis].data(), scene.sphere_count());
+        for (int axis = 0; axis < 3 && (header.flags & has_motion_flag); axis++)
+            ok = ok && write_array(file, scene.motion[axis].data(), scene.sphere_count());
+        ok = ok && write_array(file, scene.radius.data(), scene.sphere_count())
+                && std::fwrite(scene.material_id.data(), sizeof(uint32_t), scene.sphere_count(), file) == scene.sphere_count();
+
+        ok = (std::fclose(file) == 0) && ok;
+        return ok;
+    }
+
+
+  private:
+
+    // First bytes of a binary scene file (not null-terminated in the file).
+    static const char* binary_magic() { return "RTWSCENE"; }
+    static const size_t binary_magic_size = 8;
+    static const uint32_t has_motion_flag = 1;
+
+    // Start of a binary scene file. It is followed by the camera settings (name, number of values, values as
+    // doubles), the materials (name, material_type, 4 float parameters: albedo and fuzz, or the refraction index
+    // first for a dielectric), then the sphere arrays as floats: centre x, y, z, motion x, y, z (if flags has
+    // has_motion_flag), radius, then the material indices (uint32). Strings are a uint32 length and the characters.
+    struct binary_header {
+        char     magic[8];          // "RTWSCENE"
+        uint32_t version;
+        uint32_t flags;
+        uint32_t camera_settings;
+        uint32_t materials;
+        uint64_t spheres;
+    };
+
+
+    // Reads a text scene file, a block at a time. Lines are parsed in place in the block.
+    static bool read_text(FILE* file, scene_description& scene, std::string& error) {
+
+        text_parser parser(scene);
+        std::vector<char> buffer(size_t(1) << 20);
+        size_t filled = 0;          // Bytes in buffer, from the start of a line
+        bool end_of_file = false;
+
+        while (!end_of_file) {
+            size_t n = std::fread(buffer.data() + filled, 1, buffer.size() - 1 - filled, file);
+            filled += n;
+            end_of_file = n == 0;
+
+            // Parse each complete line (and, at the end of the file, the last line even without a newline).
+            size_t start = 0;
+            while (start < filled) {
+                char* line = buffer.data() + start;
+                char* newline = static_cast<char*>(std::memchr(line, '\n', filled - start));
+                if (!newline) {
+                    if (!end_of_file)
+                        break;
+                    newline = buffer.data() + filled;
+                }
+                *newline = '\0';
+                if (!parser.parse_line(line, error))
+                    return false;
+                start = size_t(newline - buffer.data()) + 1;
+            }
+
+            // Move the incomplete last line to the front of the buffer, to be completed by the next read.
+            if (start < filled) {
+                std::memmove(buffer.data(), buffer.data() + start, filled - start);
+                filled -= start;
+                if (filled == buffer.size() - 1) {
+                    error = "line " + std::to_string(parser.line_number + 1) + ": line too long";
+                    return false;
+                }
+            } else {
+                filled = 0;
+            }
+        }
+
+        return true;
+    }
+
+
+    // Parses the lines of a text scene file into a scene_description.
+    struct text_parser {
+
+        explicit text_parser(scene_description& scene) : scene(scene) {
+            for (size_t k = 0; k < scene.material_names.size(); k++)
+                material_index[scene.material_names[k]] = uint32_t(k);
+        }
+
+        scene_description& scene;
+        std::unordered_map<std::string, uint32_t> material_index;
+        long line_number = 0;
+
+        bool parse_line(char* line, std::string& error) {
+            line_number++;
+
+            if (char* comment = std::strchr(line, '#'))
+                *comment = '\0';
+
+            // Split the line into words, in place.
+            const int max_words = 10;
+            char* words[max_words + 1];
+            int count = 0;
+            for (char* p = line; *p; ) {
+                while (*p == ' ' || *p == '\t' || *p == '\r')
+                    p++;
+                if (!*p)
+                    break;
+                if (count == max_words + 1)
+                    return fail("too many values", error);
+                words[count++] = p;
+                while (*p && *p != ' ' && *p != '\t' && *p != '\r')
+                    p++;
+                if (*p)
+                    *p++ = '\0';
+            }
+            if (count == 0)
+                return true;
+
+            double v[8];
+            const char* keyword = words[0];
+
+            if (std::strcmp(keyword, "sphere") == 0 || std::strcmp(keyword, "moving_sphere") == 0) {
+                bool moving = keyword[0] == 'm';
+                int numbers = moving ? 7 : 4;
+                if (count != numbers + 2)
+                    return fail(moving ? "expected moving_sphere x1 y1 z1 x2 y2 z2 radius material"
+                                       : "expected sphere x y z radius material", error);
+                if (!parse_numbers(words + 1, numbers, v, error))
+                    return false;
+                uint32_t mat = 0;
+                if (!find_material(words[numbers + 1], mat, error))
+                    return false;
+
+                point3 center1(v[0], v[1], v[2]);
+                point3 center2 = moving ? point3(v[3], v[4], v[5]) : center1;
+                scene.add_sphere(center1, center2, v[numbers - 1], mat);
+                return true;
+            }
+
+            if (std::strcmp(keyword, "material") == 0) {
+                if (count < 3)
+                    return fail("expected material name type values", error);
+                std::string name = words[1];
+                if (material_index.count(name))
+                    return fail("material " + name + " is already defined", error);
+
+                material_description m;
+                if (std::strcmp(words[2], "lambertian") == 0) {
+                    if (count != 6 || !parse_numbers(words + 3, 3, v, error))
+                        return fail("expected material name lambertian r g b", error);
+                    m = material_description::lambertian_material(color(v[0], v[1], v[2]));
+                } else if (std::strcmp(words[2], "metal") == 0) {
+                    if (count != 7 || !parse_numbers(words + 3, 4, v, error))
+                        return fail("expected material name metal r g b fuzz", error);
+                    m = material_description::metal_material(color(v[0], v[1], v[2]), v[3]);
+                } else if (std::strcmp(words[2], "dielectric") == 0) {
+                    if (count != 4 || !parse_numbers(words + 3, 1, v, error))
+                        return fail("expected material name dielectric refraction_index", error);
+                    m = material_description::dielectric_material(v[0]);
+                } else {
+                    return fail(std::string("unknown material type ") + words[2], error);
+                }
+
+                material_index[name] = scene.add_material(m, name);
+                return true;
+            }
+
+            if (std::strcmp(keyword, "camera") == 0) {
+                if (count < 2)
+                    return fail("expected camera setting value(s)", error);
+                int size = camera_setting_size(words[1]);
+                if (size == 0)
+                    return fail(std::string("unknown camera setting ") + words[1], error);
+                if (count != size + 2)
+                    return fail(std::string("camera ") + words[1] + " takes " + std::to_string(size) + " value(s)", error);
+                if (!parse_numbers(words + 2, size, v, error))
+                    return false;
+                scene.camera_settings.push_back(camera_setting{words[1], {v[0], size > 1 ? v[1] : 0, size > 1 ? v[2] : 0}, size});
+                return true;
+            }
+
+            return fail(std::string("unknown keyword ") + keyword, error);
+        }
+
+        bool parse_numbers(char* const words[], int count, double values[], std::string& error) {
+            for (int k = 0; k < count; k++) {
+                char* end;
+                values[k] = std::strtod(words[k], &end);
+                if (end == words[k] || *end != '\0')
+                    return fail(std::string("not a number: ") + words[k], error);
+            }
+            return true;
+        }
+
+        bool find_material(const char* name, uint32_t& id, std::string& error) {
+            auto found = material_index.find(name);
+            if (found == material_index.end())
+                return fail(std::string("unknown material ") + name, error);
+            id = found->second;
+            return true;
+        }
+
+        bool fail(const std::string& message, std::string& error) const {
+            error = "line " + std::to_string(line_number) + ": " + message;
+            return false;
+        }
+    };
+
+
+    static bool read_binary(FILE* file, scene_description& scene, std::string& error) {
+
+        binary_header header;
+        if (std::fread(&header, sizeof(header), 1, file) != 1 || header.version != 1) {
+            error = "unsupported binary scene file";
+            return false;
+        }
+
+        // Check the file is long enough for the spheres before allocating for them. The count is compared with what the
+        // rest of the file could hold, rather than multiplied out, so that a huge count cannot wrap around.
+        bool moving = (header.flags & has_motion_flag) != 0;
+        uint64_t bytes_per_sphere = (moving ? 7 : 4) * sizeof(float) + sizeof(uint32_t);
+        long start = std::ftell(file);
+        std::fseek(file, 0, SEEK_END);
+        long end = std::ftell(file);
+        std::fseek(file, start, SEEK_SET);
+        if (start < 0 || end < start || header.spheres > uint64_t(end - start) / bytes_per_sphere) {
+            error = "file is truncated";
+            return false;
+        }
+
+        for (uint32_t k = 0; k < header.camera_settings; k++) {
+            camera_setting s{std::string(), {0, 0, 0}, 0};
+            uint32_t count;
+            if (!read_string(file, s.name) || !read_value(file, count) || count != uint32_t(camera_setting_size(s.name))
+                || std::fread(s.values, sizeof(double), count, file) != count) {
+                error = "bad camera setting";
+                return false;
+            }
+            s.count = int(count);
+            scene.camera_settings.push_back(s);
+        }
+
+        uint32_t first_material = uint32_t(scene.materials.size());
+        for (uint32_t k = 0; k < header.materials; k++) {
+            std::string name;
+            uint32_t type;
+            float params[4];
+            if (!read_string(file, name) || !read_value(file, type) || std::fread(params, sizeof(float), 4, file) != 4) {
+                error = "bad material";
+                return false;
+            }
+            if (type == uint32_t(material_type::lambertian))
+                scene.add_material(material_description::lambertian_material(color(params[0], params[1], params[2])), name);
+            else if (type == uint32_t(material_type::metal))
+                scene.add_material(material_description::metal_material(color(params[0], params[1], params[2]), params[3]), name);
+            else if (type == uint32_t(material_type::dielectric))
+                scene.add_material(material_description::dielectric_material(params[0]), name);
+            else {
+                error = "material " + name + " has an unknown type";
+                return false;
+            }
+        }
+
+        // The sphere arrays are read straight into the end of the scene's arrays.
+        size_t first = scene.sphere_count();
+        size_t n = size_t(header.spheres);
+        bool ok = true;
+        for (int axis = 0; axis < 3; axis++)
+            ok = ok && read_array(file, scene.center[axis], n);
+        for (int axis = 0; axis < 3; axis++) {
+            if (moving)
+                ok = ok && read_array(file, scene.motion[axis], n);
+            else
+                scene.motion[axis].resize(first + n, 0);
+        }
+        ok = ok && read_array(file, scene.radius, n);
+
+        scene.material_id.resize(first + n);
+        ok = ok && std::fread(scene.material_id.data() + first, sizeof(uint32_t), n, file) == n;
+        if (!ok) {
+            error = "file is truncated";
+            return false;
+        }
+
+        for (size_t k = first; k < first + n; k++) {
+            if (scene.material_id[k] >= header.materials) {
+                error = "sphere " + std::to_string(k - first) + " has no material";
+                return false;
+            }
+            scene.material_id[k] += first_material;
+            scene.radius[k] = std::fmax(0, scene.radius[k]);
+        }
+
+        return true;
+    }
+
+
+    // Appends n floats from file to values, converting them if real is double.
+    static bool read_array(FILE* file, std::vector<float>& values, size_t n) {
+        size_t first = values.size();
+        values.resize(first + n);
+        return std::fread(values.data() + first, sizeof(float), n, file) == n;
+    }
+
+    static bool read_array(FILE* file, std::vector<double>& values, size_t n) {
+        values.reserve(values.size() + n);
+        float chunk[4096];
+        while (n > 0) {
+            size_t count = n < 4096 ? n : 4096;
+            if (std::fread(chunk, sizeof(float), count, file) != count)
+                return false;
+            values.insert(values.end(), chunk, chunk + count);
+            n -= count;
+        }
+        return true;
+    }
+
+    // Writes n values to file as floats.
+    static bool write_array(FILE* file, const float* values, size_t n) {
+        return std::fwrite(values, sizeof(float), n, file) == n;
+    }
+
+    static bool write_array(FILE* file, const double* values, size_t n) {
+        float chunk[4096];
+        while (n > 0) {
+            size_t count = n < 4096 ? n : 4096;
+            for (size_t k = 0; k < count; k++)
+                chunk[k] = float(values[k]);
+            if (std::fwrite(chunk, sizeof(float), count, file) != count)
+                return false;
+            values += count;
+            n -= count;
+        }
+        return true;
+    }
+
+    template <typename T>
+    static bool read_value(FILE* file, T& value) {
+        return std::fread(&value, sizeof(T), 1, file) == 1;
+    }
+
+    template <typename T>
+    static bool write_value(FILE* file, const T& value) {
+        return std::fwrite(&value, sizeof(T), 1, file) == 1;
+    }
+
+    static bool read_string(FILE* file, std::string& s) {
+        uint32_t length;
+        if (!read_value(file, length) || length > 4096)
+            return false;
+        s.resize(length);
+        return length == 0 || std::fread(&s[0], 1, length, file) == length;
+    }
+
+    static bool write_string(FILE* file, const std::string& s) {
+        return write_value(file, uint32_t(s.size())) && std::fwrite(s.data(), 1, s.size(), file) == s.size();
+    }
+
+    // Formats v with the fewest digits that read back as the same real (so 0.2 is written as 0.2, not
+    // 0.20000000000000001). Returns buffer.
+    static const char* format_number(double v, char buffer[32]) {
+        for (int digits = 6; digits < std::numeric_limits<real>::max_digits10; digits++) {
+            std::snprintf(buffer, 32, "%.*g", digits, v);
+            if (real(std::strtod(buffer, nullptr)) == real(v))
+                return buffer;
+        }
+        std::snprintf(buffer, 32, "%.*g", std::numeric_limits<real>::max_digits10, v);
+        return buffer;
+    }
+};
@@ -1,6 +1,46 @@
 #pragma once
 
 #include "hittable.h"
+#include "render_stats.h"
+
+#include <algorithm>
+
+
+// Intersects every ray of a packet with a sphere whose centre is center0 + time*motion. Returns a mask with bit i set
+// if ray i hits within (t_min, t_max[i]), with the distance to the nearest such hit in roots[i].
+// The arithmetic is the same as sphere::hit(), lane by lane, with the branches replaced by selects.
+RTW_SIMD_CLONES
+inline unsigned int packet_hit_sphere(const ray_packet& p, const point3& center0, const vec3& motion, real radius, real roots[]) {
+
+    bool hits[ray_packet::size];
+
+    for (int i = 0; i < ray_packet::size; i++) {
+        real ocx = (center0[0] + p.time[i]*motion[0]) - p.orig[0][i];
+        real ocy = (center0[1] + p.time[i]*motion[1]) - p.orig[1][i];
+        real ocz = (center0[2] + p.time[i]*motion[2]) - p.orig[2][i];
+
+        real a = p.dir[0][i]*p.dir[0][i] + p.dir[1][i]*p.dir[1][i] + p.dir[2][i]*p.dir[2][i];
+        real h = p.dir[0][i]*ocx + p.dir[1][i]*ocy + p.dir[2][i]*ocz;
+        real c = (ocx*ocx + ocy*ocy + ocz*ocz) - radius*radius;
+
+        real discriminant = h*h - a*c;
+        real sqrtd = std::sqrt(std::max(discriminant, real(0)));
+
+        real near_root = (h - sqrtd) / a;
+        real far_root  = (h + sqrtd) / a;
+        bool near_ok = p.t_min < near_root && near_root < p.t_max[i];
+        bool far_ok  = p.t_min < far_root  && far_root  < p.t_max[i];
+
+        roots[i] = near_ok ? near_root : far_root;
+        hits[i] = discriminant >= 0 && (near_ok || far_ok);
+    }
+
+    unsigned int mask = 0;
+    for (int i = 0; i < ray_packet::size; i++)
+        mask |= unsigned(hits[i]) << i;
+    return mask;
+}
+
 
 // The sphere class inherits from the abstract base class, hittable
 class sphere : public hittable {
@@ -8,7 +48,7 @@ class sphere : public hittable {
   public:
 
     // Constructor requires the stationary sphere to have a centre, radius and material.
-    sphere(const point3& static_center, double radius, shared_ptr<material> mat) :
+    sphere(const point3& static_center, real radius, shared_ptr<material> mat) :
       center(static_center, vec3(0,0,0)),                                             // ray with direction (0,0,0) means sphere centre doesn't move with time
       radius(std::fmax(0,radius)), 
       mat(mat) 
@@ -19,7 +59,7 @@ class sphere : public hittable {
     
 
     // Moving Sphere has its centre at center1 at time=0, and at center2 at time=1. The centre moves linearly between those points.
-    sphere(const point3& center1, const point3& center2, double radius, shared_ptr<material> mat) :
+    sphere(const point3& center1, const point3& center2, real radius, shared_ptr<material> mat) :
       center(center1, center2 - center1),                                             // Ray with direction = center2 - center1, to linearly track sphere centre
       radius(std::fmax(0,radius)), 
       mat(mat) 
@@ -38,6 +78,8 @@ class sphere : public hittable {
     // Returns true if the specified ray intersects the sphere.
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
 
+        RTW_STAT(primitive_tests, 1);
+
         // Use the quadratic formula to determine whether the ray, r, intersects the sphere.
         point3 current_center = center.at(r.time());              // Determine the sphere centre at the time the current ray was fired
         vec3 oc = current_center - r.origin();                    // Vector pointing to the sphere centre relative to the ray origin
@@ -60,22 +102,46 @@ class sphere : public hittable {
                 return false;                           // Return false if t not in acceptable range.
         }
 
-        // Save important stuff in the hit_record object.
-        rec.t = root;                                             // Distance along ray to intersection point.
-        rec.p = r.at(rec.t);                                      // Location of intersection point in world space.
-        vec3 outward_normal = (rec.p - current_center) / radius;  // Unit outward surface normal at intersection point with sphere.
-        rec.set_face_normal(r, outward_normal);                   // Set the unit face normal (enforced to oppose the ray direction).
-        rec.mat = mat;                                            // Record a pointer to the material object associated with the sphere.
-
+        set_hit_record(r, root, current_center, rec);
         return true;
     }
 
+
+    // Tests all the rays of a packet against the sphere at once (see packet_hit_sphere()).
+    unsigned int hit_packet(ray_packet& packet, unsigned int active, hit_record recs[]) const override {
+
+        RTW_STAT(primitive_tests, render_stats::count_lanes(active));
+
+        real roots[ray_packet::size];
+        unsigned int hits = active & packet_hit_sphere(packet, center.origin(), center.direction(), radius, roots);
+
+        for (int i = 0; i < ray_packet::size; i++) {
+            if (hits >> i & 1u) {
+                ray r = packet.get(i);
+                set_hit_record(r, roots[i], center.at(r.time()), recs[i]);
+                packet.t_max[i] = roots[i];
+            }
+        }
+
+        return hits;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
 
   private:
+
+    // Save important stuff in the hit_record object.
+    void set_hit_record(const ray& r, real root, const point3& current_center, hit_record& rec) const {
+        rec.t = root;                                             // Distance along ray to intersection point.
+        rec.p = r.at(rec.t);                                      // Location of intersection point in world space.
+        vec3 outward_normal = (rec.p - current_center) / radius;  // Unit outward surface normal at intersection point with sphere.
+        rec.set_face_normal(r, outward_normal);                   // Set the unit face normal (enforced to oppose the ray direction).
+        rec.mat = mat.get();                                      // Record a (non-owning) pointer to the material object associated with the sphere.
+    }
+
     ray center;                         // Sphere centre now specified by a ray as it's time dependent
-    double radius;
+    real radius;
     shared_ptr<material> mat;           // Pointer to a material object that defines scattered ray behaviour
     aabb bbox;                          // Axis-aligned bounding box
 };
\ No newline at end of file
@@ -0,0 +1,332 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "bvh_cache.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "motion_bvh.h"
+#include "ray_packet.h"         // RTW_SIMD_CLONES
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Intersects a ray with spheres [first, first+count) of a sphere_set, all at once. Sphere k has centre
+// center[k] + time*motion[k] (one array per axis) and radius radius[k]. Returns the index of the sphere with the nearest
+// hit within (t_min, t_max) and its distance in t_hit, or -1 if no sphere is hit.
+// The arithmetic is the same as sphere::hit(), sphere by sphere, with the branches replaced by selects: the first loop
+// has no dependencies between spheres and vectorises, the second finds the nearest hit.
+RTW_SIMD_CLONES
+inline long sphere_set_hit_range(
+    const real* const center[3], const real* const motion[3], const real* radius, uint32_t first, uint32_t count,
+    const real orig[3], const real dir[3], real time, real t_min, real t_max, real& t_hit
+) {
+    const uint32_t max_count = 64;
+    real roots[max_count];
+
+    long nearest = -1;
+    t_hit = t_max;
+
+    real a = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+
+    for (uint32_t chunk = 0; chunk < count; chunk += max_count) {
+
+        uint32_t n = std::min(max_count, count - chunk);
+        uint32_t base = first + chunk;
+
+        for (uint32_t k = 0; k < n; k++) {
+            real ocx = (center[0][base+k] + time*motion[0][base+k]) - orig[0];
+            real ocy = (center[1][base+k] + time*motion[1][base+k]) - orig[1];
+            real ocz = (center[2][base+k] + time*motion[2][base+k]) - orig[2];
+
+            real h = dir[0]*ocx + dir[1]*ocy + dir[2]*ocz;
+            real c = (ocx*ocx + ocy*ocy + ocz*ocz) - radius[base+k]*radius[base+k];
+
+            real discriminant = h*h - a*c;
+            real sqrtd = std::sqrt(std::max(discriminant, real(0)));
+
+            real near_root = (h - sqrtd) / a;
+            real far_root  = (h + sqrtd) / a;
+            real root = (t_min < near_root) ? near_root : far_root;
+
+            roots[k] = (discriminant >= 0 && t_min < root) ? root : infinity;
+        }
+
+        for (uint32_t k = 0; k < n; k++) {
+            if (roots[k] < t_hit) {
+                t_hit = roots[k];
+                nearest = long(base + k);
+            }
+        }
+    }
+
+    return nearest;
+}
+
+
+// A set of spheres stored structure-of-arrays (one contiguous array per attribute) with its own linear BVH, for large
+// scenes where memory bandwidth is the limit. A sphere costs 60 bytes (32 in a float build) for its centre, motion,
+// radius and material id, rather than a separate heap allocation for each sphere object, its shared_ptr and its
+// control block.
+// Leaves of the BVH refer to ranges of the arrays, as the spheres are stored in leaf order, and all the spheres of a
+// leaf are intersected at once with sphere_set_hit_range(). If any sphere moves, the set also keeps a copy of the
+// tree with each node's box at both ends of its time window (see motion_bvh.h), and rays are tested against the boxes
+// as they are at the ray's time, rather than against boxes stretched over the spheres' whole paths.
+//
+// Add the spheres, then call build() before rendering. The set is itself a hittable, so it can be placed in a
+// hittable_list or in another BVH alongside other objects.
+class sphere_set : public hittable {
+
+  public:
+
+    sphere_set() {}
+
+    // Adds a stationary sphere (as the sphere class constructor).
+    void add(const point3& static_center, real radius, shared_ptr<material> mat) {
+        add(static_center, static_center, radius, mat);
+    }
+
+    // Adds a moving sphere, with its centre at center1 at time=0 and at center2 at time=1.
+    void add(const point3& center1, const point3& center2, real radius, shared_ptr<material> mat) {
+        vec3 motion = center2 - center1;
+        for (int axis = 0; axis < 3; axis++) {
+            center[axis].push_back(center1[axis]);
+            this->motion[axis].push_back(motion[axis]);
+        }
+        radii.push_back(std::fmax(0, radius));
+        material_ids.push_back(material_id(mat));
+    }
+
+    // Adds a material for add_spheres() to refer to, and returns its id.
+    uint32_t add_material(shared_ptr<material> mat) {
+        return material_id(mat);
+    }
+
+    // Adds spheres in bulk, from arrays of their attributes: centres at time=0 and motions (by axis), radii (not
+    // negative) and the ids of their materials (from add_material()). If the set is empty the arrays are taken over
+    // rather than copied, so loading a large scene (see scene_file.h) does not copy the spheres. The arrays are left
+    // empty.
+    void add_spheres(std::vector<real> centers[3], std::vector<real> motions[3], std::vector<real>& sphere_radii,
+                     std::vector<uint32_t>& sphere_material_ids) {
+        bool empty = size() == 0;
+        for (int axis = 0; axis < 3; axis++) {
+            move_or_append(center[axis], centers[axis], empty);
+            move_or_append(motion[axis], motions[axis], empty);
+        }
+        move_or_append(radii, sphere_radii, empty);
+        move_or_append(material_ids, sphere_material_ids, empty);
+    }
+
+    size_t size() const { return radii.size(); }
+
+
+    // Builds the BVH over the spheres and reorders them into leaf order. Must be called after the last add(). If
+    // cache_dir is set the tree is mapped from a cache file there when one was saved for the same spheres and options,
+    // and saved there otherwise (see linear_bvh_tree::build()).
+    void build(const bvh_build_options& options = default_build_options(),
+               const std::string& cache_dir = std::string()) {
+
+        std::vector<aabb> boxes(size());
+        for (size_t k = 0; k < size(); k++)
+            boxes[k] = sphere_box(k);
+
+        tree = linear_bvh_tree::build(boxes, options, cache_dir);
+        bbox = tree.bounds();
+        traversal_cost = options.traversal_cost;
+        bounds_time0 = 0;
+        bounds_time1 = 1;
+
+        moving = false;
+        for (int axis = 0; axis < 3; axis++)
+            moving = moving || std::any_of(motion[axis].begin(), motion[axis].end(), [](real m) { return m != 0; });
+
+        for (int axis = 0; axis < 3; axis++) {
+            reorder(center[axis], tree.indices());
+            reorder(motion[axis], tree.indices());
+        }
+        reorder(radii, tree.indices());
+        reorder(material_ids, tree.indices());
+
+        update_motion_nodes(options.num_threads);
+    }
+
+    // Recomputes the boxes of the BVH to enclose the spheres over the time window [time0, time1] instead of [0, 1], for
+    // rendering a frame of an animation (moving spheres carry on in a straight line outside [0, 1]). The tree keeps
+    // its structure, which is much quicker than building it again. A set with no moving spheres is left as it is.
+    // Large trees are refitted with num_threads threads (0 = all hardware threads).
+    void refit(double time0, double time1, int num_threads = 0) {
+
+        if (!moving || (time0 == bounds_time0 && time1 == bounds_time1))
+            return;
+
+        tree.refit([&](uint32_t first, uint32_t count) {
+            aabb box = aabb::empty;
+            for (size_t k = first; k < size_t(first) + count; k++)
+                box = aabb(box, sphere_box(k, time0, time1));
+            return box;
+        }, num_threads);
+        bbox = tree.bounds();
+        bounds_time0 = time0;
+        bounds_time1 = time1;
+
+        update_motion_nodes(num_threads);
+    }
+
+    // Whether any of the spheres move.
+    bool has_motion() const { return moving; }
+
+    // Whether rays are tested against the boxes of the tree at their time (see update_motion_nodes()).
+    bool uses_motion_bvh() const { return !motion_nodes.empty(); }
+
+    // Leaves with several spheres make the most of sphere_set_hit_range().
+    static bvh_build_options default_build_options() {
+        bvh_build_options options;
+        options.split = bvh_split_method::sah;
+        options.max_leaf_size = 8;
+        options.traversal_cost = 2.0;
+        return options;
+    }
+
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+
+        const real orig[3] = { r.origin().x(), r.origin().y(), r.origin().z() };
+        const real dir[3] = { r.direction().x(), r.direction().y(), r.direction().z() };
+        const real* const centers[3] = { center[0].data(), center[1].data(), center[2].data() };
+        const real* const motions[3] = { motion[0].data(), motion[1].data(), motion[2].data() };
+
+        long nearest = -1;
+        real nearest_t = ray_t.max;
+
+        auto hit_leaf = [&](uint32_t first, uint32_t count, real& closest_so_far) {
+            RTW_STAT(primitive_tests, count);
+            real t_hit;
+            long k = sphere_set_hit_range(centers, motions, radii.data(), first, count, orig, dir, r.time(),
+                                          ray_t.min, closest_so_far, t_hit);
+            if (k < 0)
+                return false;
+            nearest = k;
+            nearest_t = closest_so_far = t_hit;
+            return true;
+        };
+
+        // With moving spheres, a ray within the tree's time window is tested against the nodes' boxes at its time.
+        bool hit_anything;
+        double u = bounds_time1 > bounds_time0 ? (r.time() - bounds_time0) / (bounds_time1 - bounds_time0) : 0.0;
+        if (!motion_nodes.empty() && u >= 0 && u <= 1)
+            hit_anything = traverse_motion_bvh(motion_nodes.data(), motion_nodes.size(), r, ray_t, float(u), hit_leaf);
+        else
+            hit_anything = traverse_linear_bvh(tree.nodes(), tree.node_count(), r, ray_t, hit_leaf);
+
+        if (!hit_anything)
+            return false;
+
+        // Fill in the hit record for the nearest sphere only (as sphere::hit() does).
+        size_t k = size_t(nearest);
+        point3 current_center(center[0][k] + r.time()*motion[0][k],
+                              center[1][k] + r.time()*motion[1][k],
+                              center[2][k] + r.time()*motion[2][k]);
+
+        rec.t = nearest_t;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - current_center) / radii[k];
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = materials[material_ids[k]].get();
+
+        return true;
+    }
+
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return tree.node_count(); }
+
+    // Expected cost of a ray through the tree (see bvh_sah_cost()), for comparing builders.
+    double sah_cost() const { return bvh_sah_cost(tree.nodes(), tree.node_count(), traversal_cost); }
+
+    // Whether build() mapped the tree from a cache file rather than building it.
+    bool bvh_from_cache() const { return tree.from_cache(); }
+
+
+  private:
+    std::vector<real> center[3];                  // Sphere centres at time=0, by axis
+    std::vector<real> motion[3];                  // Movement of the centres between time=0 and time=1, by axis
+    std::vector<real> radii;
+    std::vector<uint32_t> material_ids;             // Index into materials
+
+    std::vector<shared_ptr<material>> materials;    // Each distinct material used by the spheres, once
+    std::unordered_map<const material*, uint32_t> material_index;
+
+    linear_bvh_tree tree;                           // BVH over the spheres (leaves index the arrays above)
+    std::vector<motion_bvh_node> motion_nodes;      // The same tree with boxes at the ends of its time window (if any sphere moves)
+    aabb bbox;
+    double traversal_cost = 1.0;                  // Node cost the tree was built with (relative to a sphere)
+    double bounds_time0 = 0, bounds_time1 = 1;      // Time window the boxes of the tree enclose the spheres over
+    bool moving = false;                            // Whether any sphere moves
+    static constexpr double motion_bvh_max_shrinkage = 0.5;    // Largest motion_bvh_shrinkage() at which motion_nodes are kept
+
+
+    uint32_t material_id(const shared_ptr<material>& mat) {
+        auto found = material_index.find(mat.get());
+        if (found != material_index.end())
+            return found->second;
+
+        uint32_t id = uint32_t(materials.size());
+        materials.push_back(mat);
+        material_index[mat.get()] = id;
+        return id;
+    }
+
+    // Makes motion_nodes from the tree, for the time window of its boxes. Only sets with moving spheres have them.
+    void update_motion_nodes(int num_threads) {
+        motion_nodes.clear();
+        if (!moving)
+            return;
+
+        motion_nodes = make_motion_bvh(tree.nodes(), tree.node_count(), bounds_time0, bounds_time1,
+            [&](uint32_t first, uint32_t count, double time) {
+                aabb box = aabb::empty;
+                for (size_t k = first; k < size_t(first) + count; k++)
+                    box = aabb(box, sphere_box(k, time, time));
+                return box;
+            }, num_threads);
+
+        // The interpolated boxes take twice the memory, and a little arithmetic per node, so they only pay for
+        // themselves if they are much smaller than the boxes of the whole window: when spheres move far compared with
+        // their size and spacing. Otherwise the tree is traversed as it is.
+        if (motion_bvh_shrinkage(motion_nodes.data(), tree.nodes(), tree.node_count(), traversal_cost) > motion_bvh_max_shrinkage)
+            motion_nodes.clear();
+    }
+
+    // Box enclosing sphere k over the times [time0, time1] (by default time=0 and time=1, as the sphere class does).
+    aabb sphere_box(size_t k, double time0 = 0, double time1 = 1) const {
+        auto rvec = vec3(radii[k], radii[k], radii[k]);
+        point3 center0(center[0][k], center[1][k], center[2][k]);
+        vec3 velocity(motion[0][k], motion[1][k], motion[2][k]);
+        point3 center1 = center0 + time0 * velocity;
+        point3 center2 = center0 + time1 * velocity;
+        return aabb(aabb(center1 - rvec, center1 + rvec), aabb(center2 - rvec, center2 + rvec));
+    }
+
+    template <typename T>
+    static void move_or_append(std::vector<T>& to, std::vector<T>& from, bool take_over) {
+        if (take_over)
+            to.swap(from);
+        else
+            to.insert(to.end(), from.begin(), from.end());
+        from.clear();
+    }
+
+    template <typename T>
+    static void reorder(std::vector<T>& values, const uint32_t* order) {
+        std::vector<T> reordered(values.size());
+        for (size_t k = 0; k < values.size(); k++)
+            reordered[k] = values[order[k]];
+        values.swap(reordered);
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A rectangular block of pixels, [x0,x1) x [y0,y1), rendered as a single unit of work.
+struct tile {
+    int index;          // Position of the tile in scanline order
+    int x0, y0;         // Top-left pixel of the tile (inclusive)
+    int x1, y1;         // Bottom-right pixel of the tile (exclusive)
+};
+
+
+// Splits an image into tiles and runs them across a pool of worker threads with work stealing.
+// Each worker owns a queue of tiles. It takes work from the front of its own queue and, once that is empty,
+// steals from the back of another worker's queue. Expensive regions of the image (e.g., glass) therefore
+// don't leave the other workers idle.
+class tile_scheduler {
+
+  public:
+
+    tile_scheduler(int image_width, int image_height, int tile_size, int num_workers) :
+      tiles(split_image(image_width, image_height, tile_size)),
+      queues(num_workers < 1 ? 1 : num_workers)
+    {
+        // Deal out contiguous runs of tiles so that each worker starts on a coherent part of the image.
+        size_t n_queues = queues.size();
+        for (size_t q = 0; q < n_queues; q++) {
+            size_t first = tiles.size() * q / n_queues;
+            size_t last  = tiles.size() * (q+1) / n_queues;
+            for (size_t t = first; t < last; t++)
+                queues[q].tiles.push_back(int(t));
+        }
+    }
+
+    // Splits an image into tile_size x tile_size tiles (smaller at the right and bottom edges), in scanline order.
+    static std::vector<tile> split_image(int image_width, int image_height, int tile_size) {
+        tile_size = (tile_size < 1) ? 1 : tile_size;
+
+        std::vector<tile> tiles;
+        for (int y0 = 0; y0 < image_height; y0 += tile_size)
+            for (int x0 = 0; x0 < image_width; x0 += tile_size) {
+                int index = int(tiles.size());
+                tiles.push_back(tile{index, x0, y0, std::min(x0 + tile_size, image_width), std::min(y0 + tile_size, image_height)});
+            }
+        return tiles;
+    }
+
+    int num_tiles() const { return int(tiles.size()); }
+    int num_workers() const { return int(queues.size()); }
+
+
+    // Runs render_tile(worker, tile) for every tile, spread over num_workers() threads. Returns once all tiles are done.
+    void run(const std::function<void(int, const tile&)>& render_tile) {
+
+        auto worker_loop = [&](int worker) {
+            int t;
+            while (next_tile(worker, t))
+                render_tile(worker, tiles[t]);
+        };
+
+        // The calling thread acts as worker 0.
+        std::vector<std::thread> threads;
+        for (int worker = 1; worker < num_workers(); worker++)
+            threads.emplace_back(worker_loop, worker);
+
+        worker_loop(0);
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+
+  private:
+
+    // A worker's queue of tile indices. Tiles are coarse, so a mutex per queue is cheap enough.
+    struct tile_queue {
+        std::mutex lock;
+        std::deque<int> tiles;
+    };
+
+    std::vector<tile> tiles;
+    std::vector<tile_queue> queues;
+
+
+    // Gets the next tile for a worker: first from its own queue, otherwise stolen from another worker.
+    // Returns false when there is no work left anywhere.
+    bool next_tile(int worker, int& t) {
+
+        {
+            tile_queue& own = queues[worker];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tiles.empty()) {
+                t = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+
+        // Steal from the back of the other queues (work furthest from where the victim is currently rendering).
+        for (int offset = 1; offset < num_workers(); offset++) {
+            tile_queue& victim = queues[(worker + offset) % num_workers()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tiles.empty()) {
+                t = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
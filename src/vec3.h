@@ -1,22 +1,26 @@
 #pragma once
 #include <iostream>
 
-class vec3 {
+// 3D vector with components of scalar type T. The renderer uses basic_vec3<real> (vec3, see rtweekend.h).
+template <typename T>
+class basic_vec3 {
   public:
-    double e[3];
+    using scalar = T;
 
-    vec3() : e{0,0,0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    T e[3];
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    basic_vec3() : e{0,0,0} {}
+    basic_vec3(T e0, T e1, T e2) : e{e0, e1, e2} {}
 
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
 
-    vec3& operator+=(const vec3& v) {
+    basic_vec3 operator-() const { return basic_vec3(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
+
+    basic_vec3& operator+=(const basic_vec3& v) {
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
@@ -24,7 +28,7 @@ class vec3 {
     }
 
     // Multiply components by a constant and return reference to self
-    vec3& operator*=(double t) {
+    basic_vec3& operator*=(T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
@@ -32,17 +36,17 @@ class vec3 {
     }
 
     // Divide components by a constant and return reference to self (in terms of multiplcative operator defined above)
-    vec3& operator/=(double t) {
+    basic_vec3& operator/=(T t) {
         return *this *= 1/t;
     }
 
     // RMS vector length
-    double length() const {
+    T length() const {
         return std::sqrt(length_squared());
     }
 
     // v.v
-    double length_squared() const {
+    T length_squared() const {
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
 
@@ -52,62 +56,75 @@ class vec3 {
         return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
     }
 
-    static vec3 random() {
-        return vec3(random_double(), random_double(), random_double());     // 0 <= random_double() <= 1.0
+    static basic_vec3 random() {
+        return basic_vec3(random_double(), random_double(), random_double());     // 0 <= random_double() <= 1.0
     }
 
-    static vec3 random(double min, double max) {
-        return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+    static basic_vec3 random(double min, double max) {
+        return basic_vec3(random_double(min,max), random_double(min,max), random_double(min,max));
     }
 };
 
+using vec3 = basic_vec3<real>;
+
 // point3 is just an alias for vec3, but useful for geometric clarity in the code.
 using point3 = vec3;
 
 
 // Vector Utility Functions
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const basic_vec3<T>& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator+(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator-(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator-(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(const vec3& u, const vec3& v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+// The scalar is taken as the vector's own scalar type (it is not deduced), so that e.g. 0.5*v works for any T.
+template <typename T>
+inline basic_vec3<T> operator*(typename basic_vec3<T>::scalar t, const basic_vec3<T>& v) {
+    return basic_vec3<T>(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T>& v, typename basic_vec3<T>::scalar t) {
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+template <typename T>
+inline basic_vec3<T> operator/(const basic_vec3<T>& v, typename basic_vec3<T>::scalar t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+template <typename T>
+inline T dot(const basic_vec3<T>& u, const basic_vec3<T>& v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+template <typename T>
+inline basic_vec3<T> cross(const basic_vec3<T>& u, const basic_vec3<T>& v) {
+    return basic_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(const vec3& v) {
+template <typename T>
+inline basic_vec3<T> unit_vector(const basic_vec3<T>& v) {
     return v / v.length();
 }
 
@@ -148,9 +165,9 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
 // Get direction of refracted ray
 inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
 
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);                                           // -ve due to ray being in direction opposed to surface normal.
+    real cos_theta = std::fmin(dot(-uv, n), real(1));                                           // -ve due to ray being in direction opposed to surface normal.
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);                                 // Perpendicular ray direction
-    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;     // Parallel ray direction
+    vec3 r_out_parallel = -std::sqrt(std::fabs(real(1) - r_out_perp.length_squared())) * n;     // Parallel ray direction
 
     // Return refracted ray direction
     return r_out_perp + r_out_parallel;
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "hittable.h"
+#include "material.h"
+#include "render_stats.h"
+#include "russian_roulette.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// A path tracer that advances a whole batch of paths one bounce at a time, instead of following each path to its end
+// before starting the next (camera::ray_color()). Each bounce runs as separate stages over the batch:
+//
+//   1. extend: find the closest hit of every path's ray,
+//   2. sort:   paths that escaped pick up the background; the rest are queued by the type of material they hit,
+//   3. shade:  each material type scatters its queue in its own loop (with no virtual dispatch), and the paths that
+//              scatter are appended to the next bounce's (compacted) batch.
+//
+// Each stage is a tight loop doing the same work for every path, on a compact array of per-path state. Random numbers
+// come from the same (pixel, sample, bounce) sequences as the other integrator (see sampler.h), so images differ from
+// it only by floating point rounding.
+class wavefront_integrator {
+
+  public:
+
+    wavefront_integrator(const hittable& world, int max_depth, const russian_roulette& roulette, color (*background)(const ray&)) :
+      world(world),
+      max_depth(max_depth),
+      roulette(roulette),
+      background(background) {}
+
+
+    // Adds a camera ray to the batch. pixel and sample identify the ray's random number sequences; the colour the path
+    // gathers is added to radiance[slot] by trace().
+    void add_path(const ray& r, uint64_t pixel, uint32_t sample, uint32_t slot) {
+        paths.push_back(path_state{r, color(1,1,1), pixel, sample, slot, 0});
+    }
+
+    size_t size() const { return paths.size(); }
+
+
+    // Traces every path in the batch to completion, adding the colour of each to radiance[its slot]. Empties the batch.
+    void trace(color radiance[]) {
+
+        // If the bounce limit allows no rays at all, no light is gathered.
+        if (max_depth <= 0)
+            paths.clear();
+
+        while (!paths.empty()) {
+
+            // Extend
+            hits.resize(paths.size());
+            recs.resize(paths.size());
+            for (size_t i = 0; i < paths.size(); i++) {
+                RTW_STAT(rays, 1);
+                uint64_t cost_mark = render_stats::mark();
+
+                // ray_t_min stops shadow acne (as in camera::ray_color()).
+                hits[i] = world.hit(paths[i].r, interval(ray_t_min, infinity), recs[i]);
+
+                render_stats::add_pixel_cost(paths[i].pixel, cost_mark);
+            }
+
+            // Sort
+            for (auto& queue : queues)
+                queue.clear();
+            for (size_t i = 0; i < paths.size(); i++) {
+                const path_state& path = paths[i];
+                if (hits[i]) {
+                    queues[int(recs[i].mat->type())].push_back(uint32_t(i));
+                } else {
+                    radiance[path.slot] += path.throughput * background(path.r);
+                    RTW_STAT_PATH(path.bounces + 1);
+                }
+            }
+
+            // Shade
+            next_paths.clear();
+            shade<lambertian>(queues[int(material_type::lambertian)]);
+            shade<metal>(queues[int(material_type::metal)]);
+            shade<dielectric>(queues[int(material_type::dielectric)]);
+            shade<material>(queues[int(material_type::other)]);
+
+            paths.swap(next_paths);
+        }
+    }
+
+
+  private:
+
+    // Everything needed to continue a path.
+    struct path_state {
+        ray r;                  // Ray to trace next
+        color throughput;       // Product of the attenuations of the bounces so far
+        uint64_t pixel;         // Pixel and sample number, for the random number sequence (see sampler.h)
+        uint32_t sample;
+        uint32_t slot;          // Where the path's colour is accumulated
+        int bounces;            // Number of scattering events so far
+    };
+
+    const hittable& world;
+    int max_depth;
+    russian_roulette roulette;
+    color (*background)(const ray&);
+
+    std::vector<path_state> paths;              // Paths to extend in this bounce
+    std::vector<path_state> next_paths;         // Paths that scattered, to extend in the next bounce
+    std::vector<char> hits;                     // Whether paths[i] hit anything...
+    std::vector<hit_record> recs;               // ...and if so, where
+    std::vector<uint32_t> queues[4];            // Indices of the paths that hit each material_type
+
+
+    // Scatters the paths in queue, which all hit a material of type M, and keeps the ones that are neither absorbed nor
+    // ended by Russian roulette.
+    template <typename M>
+    void shade(const std::vector<uint32_t>& queue) {
+        for (auto i : queue) {
+            const path_state& path = paths[i];
+            const hit_record& rec = recs[i];
+
+            // If the path has reached the bounce limit, no more light is gathered.
+            if (path.bounces + 1 >= max_depth) {
+                RTW_STAT_PATH(path.bounces + 1);
+                continue;
+            }
+
+            // Random numbers for this scattering event come from their own (pixel, sample, bounce) sequence.
+            sampler::begin_sample(path.pixel, path.sample);
+            sampler::begin_bounce(uint32_t(path.bounces + 1));
+
+            ray scattered;
+            color attenuation;
+            if (!scatter(static_cast<const M*>(rec.mat), path.r, rec, attenuation, scattered)) {
+                RTW_STAT_PATH(path.bounces + 1);
+                continue;
+            }
+
+            color throughput = path.throughput * attenuation;
+            if (roulette.survives(path.bounces + 1, throughput))
+                next_paths.push_back(path_state{scattered, throughput, path.pixel, path.sample, path.slot, path.bounces + 1});
+            else
+                RTW_STAT_PATH(path.bounces + 1);
+        }
+    }
+
+    // Calls the scatter() of exactly type M, without virtual dispatch...
+    template <typename M>
+    static bool scatter(const M* mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) {
+        return mat->M::scatter(r_in, rec, attenuation, scattered);
+    }
+
+    // ...apart from materials of other types, which need it.
+    static bool scatter(const material* mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) {
+        return mat->scatter(r_in, rec, attenuation, scattered);
+    }
+};
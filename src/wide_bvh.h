@@ -0,0 +1,252 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray_packet.h"         // RTW_SIMD_CLONES
+#include "render_stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// A node of a wide BVH with up to width children. The children's boxes are stored structure-of-arrays (all the
+// minimum x values together, and so on), so a ray can be tested against every child box at once with SIMD.
+// Leaves are stored directly in the child slots, as in a binary linear_bvh_node.
+template <int width>
+struct wide_bvh_node {
+    float    min_x[width], min_y[width], min_z[width];     // Child bounding boxes (single precision, rounded outwards)
+    float    max_x[width], max_y[width], max_z[width];
+    uint32_t child[width];          // Interior child: index of its node. Leaf child: index of its first primitive.
+    uint16_t count[width];          // Number of primitives in a leaf child (0 for an interior child)
+    uint8_t  num_children;          // Number of slots in use (the rest are never hit)
+};
+
+
+// Tests a ray against every child box of a wide node. Returns a mask with bit k set if the ray enters child k within
+// (t_min, t_max), and the distance at which it enters each child in t_enter[k].
+// Each child is a lane and all lanes run to completion, with no per-axis loop or early out.
+template <int width>
+inline unsigned int wide_hit_boxes(
+    const wide_bvh_node<width>& node, const real orig[3], const real inv_dir[3], real t_min, real t_max, real t_enter[]
+) {
+    bool hits[width];
+
+    for (int k = 0; k < width; k++) {
+        real tx0 = (node.min_x[k] - orig[0]) * inv_dir[0];
+        real tx1 = (node.max_x[k] - orig[0]) * inv_dir[0];
+        real ty0 = (node.min_y[k] - orig[1]) * inv_dir[1];
+        real ty1 = (node.max_y[k] - orig[1]) * inv_dir[1];
+        real tz0 = (node.min_z[k] - orig[2]) * inv_dir[2];
+        real tz1 = (node.max_z[k] - orig[2]) * inv_dir[2];
+
+        real enter = std::max(std::max(t_min, std::min(tx0, tx1)), std::max(std::min(ty0, ty1), std::min(tz0, tz1)));
+        real exit  = std::min(std::min(t_max, std::max(tx0, tx1)), std::min(std::max(ty0, ty1), std::max(tz0, tz1)));
+
+        t_enter[k] = enter;
+        hits[k] = enter < exit;
+    }
+
+    unsigned int mask = 0;
+    for (int k = 0; k < width; k++)
+        mask |= unsigned(hits[k]) << k;
+    return mask & ((1u << node.num_children) - 1);
+}
+
+// Instruction set specific versions of wide_hit_boxes() for the two supported widths.
+RTW_SIMD_CLONES
+inline unsigned int wide_hit_boxes_4(const wide_bvh_node<4>& node, const real orig[3], const real inv_dir[3], real t_min, real t_max, real t_enter[]) {
+    return wide_hit_boxes(node, orig, inv_dir, t_min, t_max, t_enter);
+}
+
+RTW_SIMD_CLONES
+inline unsigned int wide_hit_boxes_8(const wide_bvh_node<8>& node, const real orig[3], const real inv_dir[3], real t_min, real t_max, real t_enter[]) {
+    return wide_hit_boxes(node, orig, inv_dir, t_min, t_max, t_enter);
+}
+
+inline unsigned int hit_children(const wide_bvh_node<4>& node, const real orig[3], const real inv_dir[3], real t_min, real t_max, real t_enter[]) {
+    return wide_hit_boxes_4(node, orig, inv_dir, t_min, t_max, t_enter);
+}
+
+inline unsigned int hit_children(const wide_bvh_node<8>& node, const real orig[3], const real inv_dir[3], real t_min, real t_max, real t_enter[]) {
+    return wide_hit_boxes_8(node, orig, inv_dir, t_min, t_max, t_enter);
+}
+
+
+// A BVH with width (4 or 8) children per node, made by collapsing a binary tree from bvh_builder: each wide node
+// takes the place of up to log2(width) levels of the binary tree. Traversal visits a quarter or an eighth as many
+// nodes, with one SIMD box test per node in place of a chain of branchy binary box tests.
+template <int width>
+class wide_bvh : public hittable {
+
+  public:
+
+    static_assert(width == 4 || width == 8, "wide_bvh supports 4 or 8 children per node");
+
+    static const int max_depth = 64;                    // Depth of the binary tree the wide tree is collapsed from
+    static const int stack_size = max_depth * width;    // Size of the traversal stack
+
+    wide_bvh(const hittable_list& list, const bvh_build_options& options = bvh_build_options()) :
+      wide_bvh(list.objects, options) {}
+
+    wide_bvh(const std::vector<shared_ptr<hittable>>& objects, const bvh_build_options& options = bvh_build_options()) {
+
+        std::vector<aabb> boxes;
+        boxes.reserve(objects.size());
+        for (const auto& object : objects)
+            boxes.push_back(object->bounding_box());
+
+        bvh_builder builder(boxes, options);
+        bbox = builder.bounds;
+        if (!builder.nodes.empty())
+            collapse(builder.nodes, 0);
+
+        // Store the primitives in leaf order, so that each leaf refers to a contiguous range.
+        owned.reserve(objects.size());
+        primitives.reserve(objects.size());
+        for (auto index : builder.indices) {
+            owned.push_back(objects[index]);
+            primitives.push_back(objects[index].get());
+        }
+    }
+
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+
+        if (nodes.empty())
+            return false;
+
+        const real orig[3] = { r.origin().x(), r.origin().y(), r.origin().z() };
+        const real inv_dir[3] = { r.inv_direction().x(), r.inv_direction().y(), r.inv_direction().z() };
+
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        // Children still to be visited, with the distance at which the ray enters them.
+        struct entry {
+            uint32_t child;
+            uint16_t count;
+            real t_enter;
+        };
+        entry stack[stack_size];
+        int stack_top = 0;
+        stack[stack_top++] = entry{0, 0, ray_t.min};
+
+        while (stack_top > 0) {
+            const entry e = stack[--stack_top];
+
+            // Skip children that the ray only reaches beyond the closest hit found since they were pushed.
+            if (e.t_enter >= closest_so_far)
+                continue;
+
+            if (e.count > 0) {
+                for (uint32_t i = e.child; i < e.child + e.count; i++) {
+                    if (primitives[i]->hit(r, interval(ray_t.min, closest_so_far), rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            const wide_bvh_node<width>& node = nodes[e.child];
+            RTW_STAT(node_visits, 1);
+            RTW_STAT(box_tests, node.num_children);
+            real t_enter[width];
+            unsigned int mask = hit_children(node, orig, inv_dir, ray_t.min, closest_so_far, t_enter);
+
+            // Sort the hit children nearest first, then push them furthest first so that the nearest is popped next.
+            int order[width];
+            int n_hit = 0;
+            for (int k = 0; k < width; k++) {
+                if (!(mask >> k & 1u))
+                    continue;
+                int pos = n_hit++;
+                while (pos > 0 && t_enter[order[pos-1]] > t_enter[k]) {
+                    order[pos] = order[pos-1];
+                    pos--;
+                }
+                order[pos] = k;
+            }
+
+            for (int n = n_hit - 1; n >= 0; n--) {
+                int k = order[n];
+                stack[stack_top++] = entry{node.child[k], node.count[k], t_enter[k]};
+            }
+        }
+
+        return hit_anything;
+    }
+
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+
+  private:
+    std::vector<wide_bvh_node<width>> nodes;        // Depth-first wide tree (nodes[0] is the root)
+    std::vector<const hittable*> primitives;        // Primitives in leaf order (non-owning, for traversal)
+    std::vector<shared_ptr<hittable>> owned;        // Keeps the primitives alive
+    aabb bbox;                                      // Bounding box of all primitives
+
+
+    // Makes the wide node that replaces binary node b and its descendants, down to width children. Returns its index.
+    uint32_t collapse(const std::vector<linear_bvh_node>& binary, uint32_t b) {
+
+        // Start from b's children (or b itself, if the whole tree is one leaf), then repeatedly open up the interior
+        // child with the largest surface area (the one most likely to be hit) until the node is full.
+        std::vector<uint32_t> children;
+        if (binary[b].is_leaf()) {
+            children.push_back(b);
+        } else {
+            children.push_back(b + 1);
+            children.push_back(binary[b].offset);
+        }
+
+        while (int(children.size()) < width) {
+            int largest = -1;
+            double largest_area = -1;
+            for (size_t k = 0; k < children.size(); k++) {
+                const linear_bvh_node& child = binary[children[k]];
+                if (!child.is_leaf() && child.bounds().surface_area() > largest_area) {
+                    largest = int(k);
+                    largest_area = child.bounds().surface_area();
+                }
+            }
+            if (largest < 0)
+                break;
+
+            uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children.push_back(binary[opened].offset);
+        }
+
+        uint32_t node_index = uint32_t(nodes.size());
+        nodes.push_back(wide_bvh_node<width>());
+
+        wide_bvh_node<width> node = wide_bvh_node<width>();
+        node.num_children = uint8_t(children.size());
+        for (size_t k = 0; k < children.size(); k++) {
+            const linear_bvh_node& child = binary[children[k]];
+            node.min_x[k] = child.bounds_min[0];
+            node.min_y[k] = child.bounds_min[1];
+            node.min_z[k] = child.bounds_min[2];
+            node.max_x[k] = child.bounds_max[0];
+            node.max_y[k] = child.bounds_max[1];
+            node.max_z[k] = child.bounds_max[2];
+            node.count[k] = child.count;
+            node.child[k] = child.is_leaf() ? child.offset : collapse(binary, children[k]);
+        }
+
+        nodes[node_index] = node;
+        return node_index;
+    }
+};
+
+
+// The two supported widths: 4 children (fits AVX2 double precision) and 8 children (fits AVX-512).
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;